@@ -0,0 +1,900 @@
+/*
+ *  Converter from MX into Sphinx source documentation formats -
+ *  microbenchmarks of the parsing and expansion kernels.
+ *
+ *  Copyright (C) 2010 Alex Dubov <oakad@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The kernels are file local, so the converter is built right in */
+#include "mx2sphinx.cpp"
+
+#include <algorithm>
+#include <random>
+#include <tuple>
+#include <csignal>
+
+/* Results are accumulated here, so the benchmarked calls are not optimized
+ * away.
+ */
+static volatile size_t bench_sink;
+static string bench_filter;
+
+/* Runs "f" in samples of at least 10ms each and reports the median time per
+ * call, with the median absolute deviation and the best sample.
+ */
+template <typename func_t>
+static void bench(const string &name, func_t f)
+{
+	const unsigned int samples(21);
+	size_t iters(1);
+	vector<double> t_op;
+
+	if (name.find(bench_filter) == string::npos)
+		return;
+
+	while (true) {
+		double t_start(mono_time());
+
+		for (size_t cnt(0); cnt < iters; ++cnt)
+			f();
+
+		if ((mono_time() - t_start) >= 0.01)
+			break;
+
+		iters *= 2;
+	}
+
+	for (unsigned int s(0); s < samples; ++s) {
+		double t_start(mono_time());
+
+		for (size_t cnt(0); cnt < iters; ++cnt)
+			f();
+
+		t_op.push_back((mono_time() - t_start) * 1e9 / iters);
+	}
+
+	sort(t_op.begin(), t_op.end());
+
+	double median(t_op[samples / 2]);
+	vector<double> dev;
+
+	BOOST_FOREACH(double t, t_op)
+		dev.push_back(t > median ? t - median : median - t);
+
+	sort(dev.begin(), dev.end());
+
+	cout << boost::format("%-36s %12.1f ns %7.2f%% %12.1f ns %10u\n")
+		% name % median % (dev[samples / 2] * 100 / median) % t_op[0]
+		% iters;
+}
+
+/* Best time per call of "f" out of 3 samples, each repeated for at least
+ * 5ms.
+ */
+template <typename func_t>
+static double time_per_call(func_t f)
+{
+	double rv(0);
+
+	for (unsigned int s(0); s < 3; ++s) {
+		size_t iters(0);
+		double t_start(mono_time()), t_end;
+
+		do {
+			f();
+			++iters;
+			t_end = mono_time();
+		} while ((t_end - t_start) < 0.005);
+
+		if (!s || ((t_end - t_start) / iters) < rv)
+			rv = (t_end - t_start) / iters;
+	}
+
+	return rv;
+}
+
+static string repeat(const string &s, size_t len)
+{
+	string rv;
+
+	while (rv.size() < len)
+		rv += s;
+
+	return rv;
+}
+
+typedef function<string (size_t)> line_gen_t;
+typedef function<void (const string &)> matcher_t;
+
+/* Lines built to make backtracking matchers blow up: openers and marks
+ * which are never closed, long space runs between words and the like.
+ */
+static const vector<pair<string, line_gen_t>> adversarial_lines {
+	{"unclosed braces", [](size_t n) { return "@emph" + repeat("{", n); }},
+	{"many unclosed marks", [](size_t n) { return repeat("@emph{a ", n); }},
+	{"nested braces", [](size_t n) {
+		return "@code" + repeat("{", n / 2) + repeat("}", n / 2);
+	}},
+	{"unclosed parens", [](size_t n) { return "@:m" + repeat("(", n); }},
+	{"many unclosed refs", [](size_t n) { return repeat("@:m(a ", n); }},
+	{"sibling groups", [](size_t n) {
+		return "@:m(" + repeat("a(), ", n) + ")@";
+	}},
+	{"refs without end", [](size_t n) { return repeat("@:abc ", n); }},
+	{"dead refs", [](size_t n) { return repeat("@!!a(", n); }},
+	{"escaped mark ends", [](size_t n) { return repeat("@[a \\@ ", n); }},
+	{"text marks", [](size_t n) { return repeat("@`a ", n); }},
+	{"space runs", [](size_t n) {
+		return "@item a" + repeat(" ", n) + "b" + repeat(" ", n);
+	}},
+	{"many hrefs", [](size_t n) {
+		return "<a " + repeat("href=x ", n) + ">" + repeat("a> ", n);
+	}},
+	{"escaped quotes", [](size_t n) {
+		return "<a href=\"" + repeat("\\\"> ", n) + "</a>";
+	}},
+	{"nested csv", [](size_t n) { return repeat("(a,", n); }}
+};
+
+/* Pieces the fuzzed lines are built from: markup and macro openers and
+ * closers, escapes, separators, menu entries and plain text.
+ */
+static const vector<string> fuzz_tokens {
+	"@", "@@", "@emph", "@code", "@:m", "@!!", "@[", "@]", "@`", "@1",
+	"@[2]", "@?@", "@item", "{", "}", "(", ")", ",", "\\", "\\@",
+	"\"", "<a ", "href=", ">", "</a>", "*", "::", "`", " ", "  ", "\t",
+	"a", "abc"
+};
+
+/* "count" lines, each a random run of up to 8 tokens repeated to the asked
+ * length after a random lead-in; the same seed gives the same lines.
+ */
+static vector<pair<string, line_gen_t>> fuzz_lines(unsigned int seed,
+						   unsigned int count)
+{
+	vector<pair<string, line_gen_t>> rv;
+	mt19937 rng(seed);
+	uniform_int_distribution<size_t> token(0, fuzz_tokens.size() - 1);
+	uniform_int_distribution<unsigned int> run_len(1, 8), lead_len(0, 3);
+
+	for (unsigned int c(0); c < count; ++c) {
+		string lead, run;
+
+		for (unsigned int t(lead_len(rng)); t; --t)
+			lead += fuzz_tokens[token(rng)];
+
+		for (unsigned int t(run_len(rng)); t; --t)
+			run += fuzz_tokens[token(rng)];
+
+		rv.push_back(make_pair(
+			(boost::format("fuzz %u/%u") % seed % c).str(),
+			[lead, run](size_t n) { return lead + repeat(run, n); }
+		));
+	}
+
+	return rv;
+}
+
+/* The line matchers as they were before they were made linear, kept as a
+ * reference: "--fuzz" checks that the current ones give the same results
+ * over the fuzzed lines. They backtrack, so only short lines are used.
+ */
+namespace legacy {
+
+template <typename pair_t>
+static string trim(const pair_t &in)
+{
+	static const bx::sregex trim_expr(
+		bx::bos >> *bx::_s >> (bx::s1 = -*bx::_) >> *bx::_s >> bx::eos
+	);
+	bx::smatch what;
+
+	if (bx::regex_match(in.first, in.second, what, trim_expr))
+		return what.str(1);
+	else
+		return string();
+}
+
+const bx::sregex brace_expr(
+	(~bx::after('\\') >> '{')
+			  >> *(bx::by_ref(brace_expr)
+			       | bx::keep(*(~(bx::set = '{','}')
+					    | (bx::after('\\')
+					       >> (bx::set = '{','}')))))
+			  >> (~bx::after('\\') >> '}')
+);
+
+const bx::sregex paren_expr(
+	(~bx::after('\\') >> '(')
+			  >> *(bx::by_ref(paren_expr)
+			       | bx::keep(*(~(bx::set = '(',')')
+					    | (bx::after('\\')
+					       >> (bx::set = '(',')')))))
+			  >> (~bx::after('\\') >> ')')
+);
+
+const bx::sregex csv_char_expr(
+	 (bx::after('\\') >> ',') | ~bx::as_xpr(',')
+);
+
+const bx::sregex csv_simple_expr(
+	(bx::bos | (~bx::after('\\') >> ','))
+	>> (bx::s1 = *csv_char_expr)
+);
+
+const bx::sregex csv_paren_expr(
+	(bx::bos | (~bx::after('\\') >> ','))
+	>> (bx::s1 = *(bx::keep(paren_expr) | (bx::after('\\') >> ',')
+					    | ~bx::as_xpr(',')))
+);
+
+template <typename pair_t>
+static void split_csv(vector<string> &out, const pair_t &in,
+		      const bx::sregex &expr = csv_simple_expr)
+{
+	bx::sregex_iterator b(in.first, in.second, expr), e;
+
+	for (; b != e; ++b)
+		out.push_back(b->str(1));
+}
+
+template <typename pair_t>
+static void parse_href(vector<string> &out, const pair_t &in)
+{
+	static const bx::sregex href_expr(
+		bx::bos >> *bx::_s >> "<a" >> +bx::_s >> -*bx::_ >> "href"
+			>> *bx::_s >> '=' >> *bx::_s
+			>> ((~bx::after('\\') >> '"' >> (bx::s1 = -*bx::_)
+			     >> ~bx::after('\\') >> '"')
+			    | (bx::s1 = *(~bx::_s
+					  | (bx::after('\\') >> bx::_s))))
+			>> -*bx::_ >> '>' >> *bx::_s >> (bx::s2 = -*bx::_)
+			>> *bx::_s >> "</a>" >> *bx::_
+	);
+
+	bx::smatch what;
+
+	if (!regex_match(in.first, in.second, what, href_expr))
+		out.push_back(trim(in));
+	else {
+		out.push_back(what.str(1));
+		out.push_back(what.str(2));
+	}
+}
+
+static bool parse_menu_line(const string &line, string &name, string &desc)
+{
+	static const bx::sregex menu_line_expr(
+		bx::bos >> *bx::_s >> '*' >> *bx::_s >> (bx::s1 = -+bx::_)
+			>> *bx::_s >> "::" >> *bx::_s >> (bx::s2 = -*bx::_)
+			>> *bx::_s >> bx::eos);
+	bx::smatch what;
+
+	if (!bx::regex_match(line, what, menu_line_expr))
+		return false;
+
+	name = what[1];
+	desc = what[2];
+	return true;
+}
+
+const bx::sregex doc_mark_expr(
+	'@' >> (((bx::s1 = (bx::set = '[', '%', '#', '`'))
+		 >> (bx::s2 = -*bx::_) >> ~bx::after('\\')
+		 >> '@' >> (bx::s4 = !bx::_d))
+		| ((((bx::s1 = 'e') >> "mph")
+		    | ("ci" >> (bx::s1 = 't') >> 'e')
+		    | ((bx::s1 = 's') >> "trong")
+		    | ((bx::s1 = 'v') >> "erb")
+		    | ((bx::s1 = 'u') >> "rl")
+		    | ((bx::s1 = 'i') >> "mage")
+		    | ('s' >> (bx::s1 = 'c'))
+		    | ('c' >> (bx::s1 = 'o') >> "de"))
+		   >> (bx::s2 = brace_expr))) >> (bx::s3 = !bx::_s)
+);
+
+const bx::sregex text_mark_expr(
+	~bx::after('\\') >> '@' >> (bx::s1 = '`') >> (bx::s2 = -*bx::_)
+	>> ~bx::after('\\') >> '@' >> (bx::s3 = bx::_d)
+);
+
+const bx::sregex sub_blk_expr(
+	'@' >> (bx::s1 = (bx::set = '{', '}', '(', ')'))
+);
+
+const bx::sregex macro_ref_expr(
+	"@:" >> (bx::s1 = -+bx::_)
+	     >> (((bx::s2 = paren_expr) >> !(~bx::after('\\') >> '@'))
+		 | ((~bx::after('\\') >> '@')
+		    | (!((bx::s3 = '\\') >> bx::_s) >> bx::eos)))
+);
+
+const bx::sregex macro_arg_expr(
+	'@' >> !((bx::s3 = '?') >> '@')
+	    >> ((bx::s2 = bx::_d) | ('[' >> (bx::s2 = +bx::_d) >> ']'))
+);
+
+const bx::sregex dead_macro_expr(
+	"@!!" >> (bx::s1 = -+bx::_)
+	      >> ((bx::s2 = paren_expr) >> !(~bx::after('\\') >> '@')
+		  | ((~bx::after('\\') >> '@') | bx::eos))
+);
+
+const bx::sregex gen_mark_expr(
+	bx::bos >> '@' >> (bx::s2 = *~bx::_s) >> *bx::_s
+		>> (bx::s3 = -*bx::_) >> *bx::_s >> bx::eos
+);
+
+const bx::sregex tag_class_expr(
+	bx::bos >> *bx::_s
+		>> ((macro_arg_expr)[mx_context::tag_class
+				     = mx_context::MACRO_ARG_TAG]
+		    | (macro_ref_expr)[mx_context::tag_class
+				       = mx_context::MACRO_REF_TAG]
+		    | (doc_mark_expr)[mx_context::tag_class
+				      = mx_context::DOC_MARK_TAG]
+		    | (sub_blk_expr)[mx_context::tag_class
+				     = mx_context::SUB_BLK_TAG])
+);
+
+const bx::sregex doc_tag_expr(
+	macro_arg_expr | doc_mark_expr
+);
+
+}
+
+/* Positions of the match and its sub-matches */
+static string match_str(const bx::smatch &what, const string &l)
+{
+	string rv;
+
+	for (size_t m(0); m < what.size(); ++m)
+		rv += what[m].matched
+		      ? (boost::format("%u:%u ") % (what[m].first - l.begin())
+			 % what[m].length()).str()
+		      : string("- ");
+
+	return rv;
+}
+
+/* Every match of "expr" over the line */
+static string all_matches(const bx::sregex &expr, const string &l)
+{
+	bx::sregex_iterator b(l.begin(), l.end(), expr), e;
+	string rv;
+
+	for (; b != e; ++b)
+		rv += match_str(*b, l) + "| ";
+
+	return rv;
+}
+
+static string join(const vector<string> &in)
+{
+	string rv;
+
+	BOOST_FOREACH(const string &s, in)
+		rv += "[" + s + "]";
+
+	return rv;
+}
+
+typedef function<string (const string &)> result_t;
+
+/* Current and legacy versions of every matcher, giving comparable results;
+ * the current expressions are run with a "line_pairs" table in scope, as
+ * they are in the conversion.
+ */
+static const vector<tuple<string, result_t, result_t>> legacy_matchers {
+	make_tuple("trim", [](const string &l) {
+		return trim(make_pair(l.begin(), l.end()));
+	}, [](const string &l) {
+		return legacy::trim(make_pair(l.begin(), l.end()));
+	}),
+	make_tuple("split_csv", [](const string &l) {
+		vector<string> out;
+
+		split_csv(out, make_pair(l.begin(), l.end()));
+		return join(out);
+	}, [](const string &l) {
+		vector<string> out;
+
+		legacy::split_csv(out, make_pair(l.begin(), l.end()));
+		return join(out);
+	}),
+	make_tuple("split_csv parens", [](const string &l) {
+		vector<string> out;
+
+		split_csv(out, make_pair(l.begin(), l.end()), true);
+		return join(out);
+	}, [](const string &l) {
+		vector<string> out;
+
+		legacy::split_csv(out, make_pair(l.begin(), l.end()),
+				  legacy::csv_paren_expr);
+		return join(out);
+	}),
+	make_tuple("parse_href", [](const string &l) {
+		vector<string> out;
+
+		parse_href(out, make_pair(l.begin(), l.end()));
+		return join(out);
+	}, [](const string &l) {
+		vector<string> out;
+
+		legacy::parse_href(out, make_pair(l.begin(), l.end()));
+		return join(out);
+	}),
+	make_tuple("menu line", [](const string &l) {
+		string name, desc;
+
+		return parse_menu_line(l, name, desc)
+		       ? "[" + name + "][" + desc + "]" : string("-");
+	}, [](const string &l) {
+		string name, desc;
+
+		return legacy::parse_menu_line(l, name, desc)
+		       ? "[" + name + "][" + desc + "]" : string("-");
+	}),
+	make_tuple("gen_mark", [](const string &l) {
+		bx::smatch what;
+
+		return bx::regex_match(l, what, mx_context::gen_mark_expr())
+		       ? match_str(what, l) : string("-");
+	}, [](const string &l) {
+		bx::smatch what;
+
+		return bx::regex_match(l, what, legacy::gen_mark_expr)
+		       ? match_str(what, l) : string("-");
+	}),
+	make_tuple("tag_class", [](const string &l) {
+		line_pairs pairs(l);
+		mx_context::tag_level_t t_class(mx_context::GEN_MARK_TAG);
+		bx::smatch what;
+
+		what.let(mx_context::tag_class = t_class);
+		if (!bx::regex_search(l, what, mx_context::tag_class_expr()))
+			return string("-");
+
+		return (boost::format("%d ") % t_class).str()
+		       + match_str(what, l);
+	}, [](const string &l) {
+		mx_context::tag_level_t t_class(mx_context::GEN_MARK_TAG);
+		bx::smatch what;
+
+		what.let(mx_context::tag_class = t_class);
+		if (!bx::regex_search(l, what, legacy::tag_class_expr))
+			return string("-");
+
+		return (boost::format("%d ") % t_class).str()
+		       + match_str(what, l);
+	}),
+	make_tuple("doc_tag", [](const string &l) {
+		line_pairs pairs(l);
+
+		return all_matches(mx_context::doc_tag_expr(), l);
+	}, [](const string &l) {
+		return all_matches(legacy::doc_tag_expr, l);
+	}),
+	make_tuple("text_mark", [](const string &l) {
+		line_pairs pairs(l);
+
+		return all_matches(mx_context::text_mark_expr(), l);
+	}, [](const string &l) {
+		return all_matches(legacy::text_mark_expr, l);
+	}),
+	make_tuple("macro_ref", [](const string &l) {
+		line_pairs pairs(l);
+
+		return all_matches(mx_context::macro_ref_expr(), l);
+	}, [](const string &l) {
+		return all_matches(legacy::macro_ref_expr, l);
+	}),
+	make_tuple("dead_macro", [](const string &l) {
+		line_pairs pairs(l);
+
+		return all_matches(mx_context::dead_macro_expr(), l);
+	}, [](const string &l) {
+		return all_matches(legacy::dead_macro_expr, l);
+	})
+};
+
+static string adversarial_case;
+
+static void adversarial_timeout(int sig)
+{
+	/* Only async signal safe calls here */
+	if (write(1, adversarial_case.data(), adversarial_case.size()) < 0)
+		_exit(2);
+
+	_exit(1);
+}
+
+/* Every matcher is run over every adversarial line at two lengths; linear
+ * time gives a ratio of 16, quadratic 256. Anything above "max_ratio" (or a
+ * line taking longer than "max_time") is reported and fails the run; a case
+ * still running after "time_limit" seconds ends it at once.
+ */
+static bool check_adversarial(const vector<pair<string, matcher_t>> &matchers,
+			      const vector<pair<string, line_gen_t>> &lines)
+{
+	const size_t short_len(4096), long_len(65536);
+	const double max_ratio(64), max_time(0.5);
+	const unsigned int time_limit(10);
+	unsigned int cases(0), failed(0);
+
+	signal(SIGALRM, adversarial_timeout);
+
+	BOOST_FOREACH(auto const &m, matchers) {
+		if (m.first.find(bench_filter) == string::npos)
+			continue;
+
+		BOOST_FOREACH(auto const &g, lines) {
+			const string s_line(g.second(short_len));
+			const string l_line(g.second(long_len));
+
+			adversarial_case = (boost::format("%-20s %-20s timed out\n")
+					    % m.first % g.first).str();
+			cout.flush();
+			alarm(time_limit);
+
+			double t_s(time_per_call([&]() { m.second(s_line); }));
+			double t_l(time_per_call([&]() { m.second(l_line); }));
+
+			alarm(0);
+			++cases;
+			if ((t_l <= max_time) && (t_l <= (max_ratio * t_s)))
+				continue;
+
+			++failed;
+			cout << boost::format("%-20s %-20s %10.1f us %10.1f us "
+					      "nonlinear\n")
+				% m.first % g.first % (t_s * 1e6) % (t_l * 1e6);
+		}
+	}
+
+	if (cases)
+		cout << boost::format("adversarial lines: %u cases, %u "
+				      "nonlinear\n") % cases % failed;
+
+	return !failed;
+}
+
+/* Every legacy matcher pair is run over every line at a few short lengths,
+ * as is and as a menu entry; a result differing from the legacy one is
+ * reported and fails the run.
+ */
+static bool check_legacy(const vector<pair<string, line_gen_t>> &lines)
+{
+	static const size_t lens[] = { 4, 8, 12, 16, 24 };
+	const unsigned int time_limit(10);
+	unsigned int cases(0), failed(0);
+
+	signal(SIGALRM, adversarial_timeout);
+
+	BOOST_FOREACH(auto const &g, lines) {
+		vector<string> g_lines;
+
+		BOOST_FOREACH(size_t len, lens) {
+			g_lines.push_back(g.second(len));
+			g_lines.push_back("* " + g.second(len));
+		}
+
+		BOOST_FOREACH(auto const &m, legacy_matchers) {
+			adversarial_case = (boost::format(
+				"%-20s %-20s legacy timed out\n"
+			) % get<0>(m) % g.first).str();
+			cout.flush();
+			alarm(time_limit);
+
+			BOOST_FOREACH(const string &line, g_lines) {
+				string r_cur(get<1>(m)(line));
+				string r_old(get<2>(m)(line));
+
+				++cases;
+				if (r_cur == r_old)
+					continue;
+
+				++failed;
+				cout << boost::format("%-20s %-20s differs on "
+						      "\"%s\"\n  current: %s\n"
+						      "  legacy:  %s\n")
+					% get<0>(m) % g.first % line % r_cur
+					% r_old;
+			}
+
+			alarm(0);
+		}
+	}
+
+	cout << boost::format("legacy matchers: %u cases, %u differ\n")
+		% cases % failed;
+
+	return !failed;
+}
+
+/* A converter state with a chain of macros "m0" .. "m<depth - 1>", each
+ * expanding the previous one.
+ */
+static void add_macro_chain(mx_context &mx, unsigned int depth)
+{
+	for (unsigned int d(0); d < depth; ++d) {
+		mx_context::macro_t &m(
+			mx.macros[(boost::format("m%u") % d).str()]
+		);
+
+		m.f_name = "bench.mx";
+		m.b_pos = m.e_pos = 1;
+
+		if (d)
+			m.lines.push_back(make_pair(
+				(boost::format("pre @:m%u(@1) post") % (d - 1))
+				.str(), 1
+			));
+		else
+			m.lines.push_back(make_pair(string("text @1 body"), 1));
+	}
+}
+
+/* A 10 line document, converted with the output thrown away */
+static void convert_small(mx_converter *mx)
+{
+	static const char doc[] = "@t Small\n\n"
+				  "Some @emph{text} and @code{code}.\n\n"
+				  "@= m\n"
+				  "macro @1 body\n"
+				  "@end\n\n"
+				  "@:m(x)@ and more.\n"
+				  "@c\n"
+				  "int a;\n";
+
+	mx_convert_buffer(mx, "small.mx", doc, sizeof(doc) - 1);
+}
+
+int main(int argc, char **argv)
+{
+	/* Before anything else, so that the expressions are not built yet */
+	shared_ptr<mx_converter> small_mx(mx_new(), mx_free);
+	double t_cold(mono_time());
+
+	mx_set_output(small_mx.get(), [](void *arg, const char *tag,
+					 const char *data, size_t len) {
+		bench_sink += len;
+	}, 0);
+	convert_small(small_mx.get());
+	t_cold = mono_time() - t_cold;
+
+	/* "--fuzz SEED [COUNT]" checks the matchers over random lines instead
+	 * of the fixed adversarial ones, and against the legacy matchers,
+	 * running nothing else
+	 */
+	unsigned int fuzz_seed(0), fuzz_count(0);
+
+	if ((argc > 1) && (string(argv[1]) == "--fuzz")) {
+		fuzz_seed = (argc > 2) ? atoi(argv[2]) : 1;
+		fuzz_count = (argc > 3) ? atoi(argv[3]) : 50;
+		bench_filter = "adversarial";
+	} else if (argc > 1)
+		bench_filter = argv[1];
+
+	file_cache cache;
+	mx_config cfg;
+
+	cache.resolver = [](const string &name, string &data) -> bool {
+		data = "@t Benchmark\n\n@c\n";
+		return true;
+	};
+	cfg.cache = &cache;
+
+	mx_context mx("bench.mx", cfg);
+	const target &t(mx.out_files[cfg.doc_tag]);
+	add_macro_chain(mx, 16);
+
+	const string blank("    \t   "), text("   some text to be trimmed  ");
+	const string csv("alpha, beta\\, gamma, delta, epsilon, zeta");
+	const string href("<a href=\"http://example.org/a/b\">Example</a>");
+	const string gen_line("@item first argument of the tag");
+	const string doc_line("See @emph{this} and @code{that} or "
+			      "@[reference@] here.");
+	const string macro_line("Text @:m0(value)@ and more text.");
+	const string markup_line("Some @strong{strong} and @verb{verbatim} "
+				 "text with @code{code} inline.");
+
+	mx_context::line_block_t block;
+
+	for (unsigned int l(0); l < 50; ++l)
+		block.push_back(make_pair(
+			string(l % 5 ? "\t    " : "\t  ")
+			+ "int var = func(arg, other_arg);", l
+		));
+
+	if (!fuzz_count)
+		cout << boost::format("%-36s %15s %8s %15s %10s\n")
+			% "benchmark" % "median" % "mad" % "min" % "iters";
+
+	if (string("convert 10 lines").find(bench_filter) != string::npos)
+		cout << boost::format("%-36s %12.1f ns %30s\n")
+			% "convert 10 lines (first, cold)" % (t_cold * 1e9)
+			% "1";
+
+	bench("convert 10 lines", [&]() {
+		convert_small(small_mx.get());
+	});
+
+	bench("is_blank", [&]() {
+		bench_sink += is_blank(make_pair(blank.begin(), blank.end()));
+	});
+
+	bench("trim", [&]() {
+		bench_sink += trim(make_pair(text.begin(), text.end())).size();
+	});
+
+	bench("split_csv", [&]() {
+		vector<string> out;
+
+		split_csv(out, make_pair(csv.begin(), csv.end()));
+		bench_sink += out.size();
+	});
+
+	bench("parse_href", [&]() {
+		vector<string> out;
+
+		parse_href(out, make_pair(href.begin(), href.end()));
+		bench_sink += out.size();
+	});
+
+	bench("gen_mark_expr match", [&]() {
+		bx::smatch what;
+
+		bench_sink += bx::regex_match(gen_line, what,
+					      mx_context::gen_mark_expr());
+	});
+
+	bench("doc_mark_expr search", [&]() {
+		line_pairs pairs(doc_line);
+		bx::sregex_iterator b(doc_line.begin(), doc_line.end(),
+				      mx_context::doc_mark_expr()), e;
+
+		bench_sink += distance(b, e);
+	});
+
+	bench("macro_ref_expr search", [&]() {
+		line_pairs pairs(macro_line);
+		bx::smatch what;
+
+		bench_sink += bx::regex_search(macro_line, what,
+					       mx_context::macro_ref_expr());
+	});
+
+	bench("replace_doc_tags", [&]() {
+		line_pairs pairs(markup_line);
+
+		bench_sink += bx::regex_replace(
+			markup_line, mx_context::doc_tag_expr(),
+			function<string (const bx::smatch&)>(
+				bind(&mx_context::replace_doc_tags, &mx,
+				     placeholders::_1)
+			)
+		).size();
+	});
+
+	const unsigned int depths[] = {1, 4, 16};
+
+	BOOST_FOREACH(unsigned int depth, depths) {
+		const string line((boost::format("Text @:m%u(value)@ end.")
+				   % (depth - 1)).str());
+
+		bench((boost::format("expand_macros depth %u") % depth).str(),
+		      [&]() {
+			mx_context::line_block_t out;
+
+			mx.expand_macros(out, make_pair(line, 1), t);
+			bench_sink += out.size();
+		});
+	}
+
+	bench("unindent_lines 50 lines (+copy)", [&]() {
+		mx_context::line_block_t m(block);
+
+		unindent_lines(m);
+		bench_sink += m.size();
+	});
+
+	bench("line_block_t copy 50 lines", [&]() {
+		mx_context::line_block_t m(block);
+
+		bench_sink += m.size();
+	});
+
+	bench("rope append 1000 lines", [&]() {
+		__gnu_cxx::crope r;
+
+		for (unsigned int l(0); l < 1000; ++l)
+			r.append(text.data(), text.size());
+
+		bench_sink += r.size();
+	});
+
+	bench("string append 1000 lines", [&]() {
+		string r;
+
+		for (unsigned int l(0); l < 1000; ++l)
+			r.append(text.data(), text.size());
+
+		bench_sink += r.size();
+	});
+
+	const vector<pair<string, matcher_t>> matchers {
+		{"adversarial trim", [](const string &l) {
+			bench_sink += trim(make_pair(l.begin(), l.end())).size();
+		}},
+		{"adversarial split_csv", [](const string &l) {
+			vector<string> out;
+
+			split_csv(out, make_pair(l.begin(), l.end()), true);
+			bench_sink += out.size();
+		}},
+		{"adversarial parse_href", [](const string &l) {
+			vector<string> out;
+
+			parse_href(out, make_pair(l.begin(), l.end()));
+			bench_sink += out.size();
+		}},
+		{"adversarial gen_mark", [](const string &l) {
+			bx::smatch what;
+
+			bench_sink += bx::regex_match(l, what,
+						      mx_context::gen_mark_expr());
+		}},
+		{"adversarial tag_class", [](const string &l) {
+			line_pairs pairs(l);
+			mx_context::tag_level_t t_class;
+			bx::smatch what;
+
+			what.let(mx_context::tag_class = t_class);
+			bench_sink += bx::regex_search(l, what,
+						       mx_context::tag_class_expr());
+		}},
+		{"adversarial doc_tag", [](const string &l) {
+			line_pairs pairs(l);
+
+			bench_sink += bx::regex_replace(
+				l, mx_context::doc_tag_expr(), string()
+			).size();
+		}},
+		{"adversarial text_mark", [](const string &l) {
+			line_pairs pairs(l);
+
+			bench_sink += bx::regex_replace(
+				l, mx_context::text_mark_expr(), string()
+			).size();
+		}},
+		{"adversarial expand_macros", [&](const string &l) {
+			mx_context::line_block_t out;
+
+			mx.expand_macros(out, make_pair(l, 1), t);
+			bench_sink += out.size();
+		}}
+	};
+
+	if (!fuzz_count)
+		return check_adversarial(matchers, adversarial_lines) ? 0 : 1;
+
+	auto f_lines(fuzz_lines(fuzz_seed, fuzz_count));
+	bool rv(check_adversarial(matchers, f_lines));
+
+	return (check_legacy(f_lines) && rv) ? 0 : 1;
+}
@@ -0,0 +1,276 @@
+/*
+ *  Converter from MX into Sphinx source documentation formats - command
+ *  line interface.
+ *
+ *  Copyright (C) 2010 Alex Dubov <oakad@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iostream>
+
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+
+#include "mx2sphinx.h"
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+	namespace po = boost::program_options;
+
+	string doc_tag, index, out_dir, sock_path, stats, profile;
+	string trace;
+	string engine;
+	vector<string> sources, includes, defines, fds, configs;
+	size_t stream_size(0), spill_size(256 << 20);
+	int rc(0);
+
+	/* Only "text" (a table) and "json" reports are there */
+	auto stats_check([](const char *opt) {
+		return [opt](const string &f) {
+			if ((f != "text") && (f != "json"))
+				throw po::validation_error(
+					po::validation_error
+					::invalid_option_value, opt, f
+				);
+		};
+	});
+
+	po::options_description desc("Options:");
+	desc.add_options()
+		("help,h", "produce this help message")
+		("doc,d", po::value<string>(&doc_tag)->default_value("rst"),
+		 "file suffix to put documentation into")
+		("index,x", po::value<string>(&index),
+		 "generate and write out index file")
+		("include,I", po::value< vector<string> >(&includes)
+			      ->composing(),
+		 "search additional paths for MX includes")
+		("define,D", po::value< vector<string> >(&defines)
+			      ->composing(),
+		 "define MX processing flags")
+		("config", po::value< vector<string> >(&configs)->composing(),
+		 "convert once per configuration, with its flags added, into "
+		 "subdirectory NAME of the output directory "
+		 "(NAME:-DFLAG,-DFLAG...); may be repeated")
+		("stream,s", po::value<size_t>(&stream_size),
+		 "write out finished parts of targets as soon as they grow "
+		 "past the given size")
+		("spill", po::value<size_t>(&spill_size)
+			  ->default_value(spill_size),
+		 "keep target text above the given size in temporary files "
+		 "(0 - never)")
+		("output,o", po::value<string>(&out_dir),
+		 "write targets into the given directory, instead of next "
+		 "to the sources")
+		("fd", po::value< vector<string> >(&fds)->composing(),
+		 "write target with suffix TAG to an open file descriptor "
+		 "(TAG=N); \"-\" as a source reads standard input and sends "
+		 "the documentation to standard output")
+		("check", "only parse the sources and report problems "
+			  "(unbalanced tags, missing includes, undefined "
+			  "macros), without writing anything")
+		("watch,w", "keep running, converting sources again whenever "
+			    "they or their includes change")
+		("server", po::value<string>(&sock_path),
+		 "serve conversion requests on the given unix socket")
+		("stats", po::value<string>(&stats)->implicit_value("text")
+			  ->notifier(stats_check("stats")),
+		 "report time spent and data processed per source to "
+		 "standard error, as a table or json (--stats=json)")
+		("stats-format", po::value<string>(&stats)
+				 ->notifier(stats_check("stats-format")),
+		 "same as --stats=...")
+		("profile", po::value<string>(&profile),
+		 "report the cost of every macro to standard error and write "
+		 "it as json into the given file")
+		("trace", po::value<string>(&trace),
+		 "write timing of the conversion steps into the given file, "
+		 "in the Chrome trace event format")
+		("memory", "report memory held by the parts of every "
+			   "conversion to standard error")
+		("engine", po::value<string>(&engine)->default_value("fast"),
+		 "conversion path: fast, legacy (no caching, streaming or "
+		 "spilling) or diff (both, comparing the output)");
+
+	po::options_description src_desc("source files");
+	src_desc.add(desc)
+		.add_options()
+		 ("sources", po::value< vector<string> >(&sources)->composing(),
+		  "sources");
+
+	po::positional_options_description src_pos;
+	src_pos.add("sources", -1);
+
+	po::variables_map desc_map;
+
+	try {
+		po::store(po::command_line_parser(argc, argv)
+			  .options(src_desc).positional(src_pos).run(),
+			  desc_map);
+		po::notify(desc_map);
+	} catch (const po::error &err) {
+		cerr << err.what() << endl;
+		return -1;
+	}
+
+	if (desc_map.count("help")) {
+		cout << "mx2sphinx version 1.0" << endl;
+		cout << "Usage: mx2sphinx [OPTION]... [FILE]..." << endl;
+		cout << desc;
+		return rc;
+	}
+
+	shared_ptr<mx_converter> mx(mx_new(), mx_free);
+
+	mx_set_warning(mx.get(), [](void *arg, const char *msg) {
+		cerr << msg << endl;
+	}, 0);
+
+	mx_set_doc_tag(mx.get(), doc_tag.c_str());
+	mx_set_output_dir(mx.get(), out_dir.c_str());
+	mx_set_stream_size(mx.get(), stream_size);
+	mx_set_spill_size(mx.get(), spill_size);
+	mx_set_check(mx.get(), desc_map.count("check"));
+	/* A batch run reads every source once, unless configurations share
+	 * the parsed sections
+	 */
+	mx_set_cache(mx.get(), desc_map.count("watch") || (configs.size() > 1));
+
+	if (mx_set_engine(mx.get(), engine.c_str())) {
+		cerr << mx_error(mx.get()) << endl;
+		return -1;
+	}
+
+	BOOST_FOREACH(const string &i, includes)
+		mx_add_include_dir(mx.get(), i.c_str());
+
+	BOOST_FOREACH(const string &d, defines)
+		mx_define(mx.get(), d.c_str());
+
+	BOOST_FOREACH(const string &c, configs) {
+		auto p(c.find(':'));
+		string name(c.substr(0, p));
+
+		if (name.empty()) {
+			cerr << "invalid configuration spec " << c << endl;
+			return -1;
+		}
+
+		mx_config_define(mx.get(), name.c_str(), 0);
+
+		while (p != string::npos) {
+			auto q(c.find(',', p + 1));
+			string d(c.substr(p + 1, q == string::npos
+						 ? string::npos : q - p - 1));
+
+			if (!d.compare(0, 2, "-D"))
+				d.erase(0, 2);
+
+			if (!d.empty())
+				mx_config_define(mx.get(), name.c_str(),
+						 d.c_str());
+
+			p = q;
+		}
+	}
+
+	if (!stats.empty())
+		mx_enable_stats(mx.get(), 1);
+
+	if (!profile.empty())
+		mx_enable_profile(mx.get(), 1);
+
+	if (!trace.empty())
+		mx_enable_trace(mx.get(), 1);
+
+	if (desc_map.count("memory"))
+		mx_enable_memory(mx.get(), 1);
+
+	if (!sock_path.empty()) {
+		mx_serve(mx.get(), sock_path.c_str());
+		cerr << "runtime error: " << mx_error(mx.get()) << endl;
+		return -1;
+	}
+
+	if (sources.empty())
+		return 0;
+
+	BOOST_FOREACH(const string &f, fds) {
+		auto p(f.find('='));
+
+		try {
+			if (p == string::npos)
+				throw boost::bad_lexical_cast();
+
+			mx_set_target_fd(mx.get(), f.substr(0, p).c_str(),
+					 boost::lexical_cast<int>(
+						 f.substr(p + 1)));
+		} catch (const boost::bad_lexical_cast &) {
+			cerr << "invalid file descriptor spec " << f << endl;
+			return -1;
+		}
+	}
+
+	BOOST_FOREACH(const string &f, sources) {
+		if (mx_convert_file(mx.get(), f.c_str()))
+			rc = -1;
+	}
+
+	if (!index.empty() && !desc_map.count("check")
+	    && mx_write_index(mx.get(), index.c_str())) {
+		cerr << "runtime error: " << mx_error(mx.get()) << endl;
+		rc = -1;
+	}
+
+	if (!stats.empty())
+		cerr << mx_stats(mx.get(), stats == "json");
+
+	if (!profile.empty()) {
+		ofstream p_out(profile.c_str());
+
+		cerr << mx_profile(mx.get(), 0);
+		p_out << mx_profile(mx.get(), 1);
+
+		if (!p_out)
+			cerr << "can't write profile " << profile << endl;
+	}
+
+	if (desc_map.count("memory"))
+		cerr << mx_memory(mx.get());
+
+	if (!trace.empty()) {
+		ofstream t_out(trace.c_str());
+
+		t_out << mx_trace(mx.get());
+
+		if (!t_out)
+			cerr << "can't write trace " << trace << endl;
+	}
+
+	if (desc_map.count("watch")) {
+		mx_watch(mx.get(), index.c_str());
+		cerr << "runtime error: " << mx_error(mx.get()) << endl;
+		rc = -1;
+	}
+
+	return rc;
+}
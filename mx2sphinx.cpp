@@ -18,24 +18,43 @@
  */
 
 #include <string>
+#include <memory>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
 #include <fstream>
 #include <iostream>
 #include <ext/rope>
 #include <functional>
+#include <tuple>
+#include <ext/stdio_filebuf.h>
 #include <initializer_list>
 
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <time.h>
+
 #include <boost/format.hpp>
 #include <boost/foreach.hpp>
-#include <boost/variant.hpp>
 #include <boost/optional.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
-#include <boost/program_options.hpp>
 #include <boost/xpressive/regex_actions.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/iterator/iterator_traits.hpp>
 #include <boost/xpressive/xpressive_static.hpp>
 
+#include "mx2sphinx.h"
+
 using namespace std;
 namespace bx = boost::xpressive;
 namespace bf = boost::filesystem;
@@ -61,8 +80,12 @@ static bool is_blank(const pair_t &in)
 template <typename pair_t>
 static string trim(const pair_t &in)
 {
+	/* Backs off to the last non-space, a lazy match would try the line
+	 * end after every character of a space run.
+	 */
 	static const bx::sregex trim_expr(
-		bx::bos >> *bx::_s >> (bx::s1 = -*bx::_) >> *bx::_s >> bx::eos
+		bx::bos >> *bx::_s >> (bx::s1 = !(*bx::_ >> ~bx::_s))
+			>> *bx::_s >> bx::eos
 	);
 	bx::smatch what;
 
@@ -72,121 +95,441 @@ static string trim(const pair_t &in)
 		return string();
 }
 
-const bx::sregex brace_expr(
-	(~bx::after('\\') >> '{')
-			  >> *(bx::by_ref(brace_expr)
-			       | bx::keep(*(~(bx::set = '{','}')
-					    | (bx::after('\\')
-					       >> (bx::set = '{','}')))))
-			  >> (~bx::after('\\') >> '}')
-);
-
-const bx::sregex paren_expr(
-	(~bx::after('\\') >> '(')
-			  >> *(bx::by_ref(paren_expr)
-			       | bx::keep(*(~(bx::set = '(',')')
-					    | (bx::after('\\')
-					       >> (bx::set = '(',')')))))
-			  >> (~bx::after('\\') >> ')')
-);
-
-const bx::sregex csv_char_expr(
-	 (bx::after('\\') >> ',') | ~bx::as_xpr(',')
-);
-
-const bx::sregex csv_simple_expr(
-	(bx::bos | (~bx::after('\\') >> ','))
-	>> (bx::s1 = *csv_char_expr)
-);
-
-const bx::sregex csv_paren_expr(
-	(bx::bos | (~bx::after('\\') >> ','))
-	>> (bx::s1 = *(bx::keep(paren_expr) | (bx::after('\\') >> ',')
-					    | ~bx::as_xpr(',')))
-);
+/* Openers of the marks below, which nothing on the line closes: "(" and "{"
+ * without a pair, "@[" and the like without a terminating "@" and "@`"
+ * without an "@<digit>". Every attempt to match one of these would scan the
+ * rest of the line, so a line full of them took quadratic time. With a
+ * table for the searched line in scope, the expressions reject them at
+ * once and find the pair of a group without descending into it; openers of
+ * any other string are still tried.
+ */
+struct line_pairs {
+	enum kind_t {
+		GROUP,
+		MARK,
+		TEXT_MARK
+	};
+
+	explicit line_pairs(const string &line_)
+	: line(line_), prev(current), mark_end(0), text_end(0), built(false)
+	{
+		current = this;
+	}
+
+	~line_pairs()
+	{
+		current = prev;
+	}
+
+	/* "c" points at the opening character */
+	static bool closed(string::const_iterator c, kind_t kind)
+	{
+		size_t pos;
+
+		if (!lookup(c, pos))
+			return true;
+
+		switch (kind) {
+		case GROUP:
+			return current->pair_pos[pos] != string::npos;
+		case MARK:
+			return pos + 1 < current->mark_end;
+		case TEXT_MARK:
+			return pos + 1 < current->text_end;
+		}
+		return true;
+	}
+
+	/* Whether "c" closes the group opened at "o" */
+	static bool paired(string::const_iterator o, string::const_iterator c)
+	{
+		size_t pos;
+
+		if (lookup(o, pos) && current->pair_pos[pos])
+			return current->pair_pos[pos] == size_t(&*c - &*o) + pos;
+
+		unsigned int depth(1);
+
+		for (auto p(o + 1); p != c; ++p) {
+			if (*(p - 1) == '\\')
+				continue;
+
+			if (*p == *o)
+				++depth;
+			else if ((*p == *c) && !--depth)
+				return false;
+		}
+
+		return depth == 1;
+	}
+
+	static bool lookup(string::const_iterator c, size_t &pos)
+	{
+		if (!current)
+			return false;
+
+		pos = &*c - current->line.data();
+		if (pos >= current->line.size())
+			return false;
+
+		if (!current->built)
+			current->build();
+
+		return true;
+	}
+
+	/* Only unescaped openers are known, the escaped ones are up to the
+	 * expressions (a search may start right after the escape).
+	 */
+	void build()
+	{
+		vector<size_t> parens, braces;
+
+		pair_pos.assign(line.size(), 0);
+		for (size_t pos(0); pos < line.size(); ++pos) {
+			if (pos && (line[pos - 1] == '\\'))
+				continue;
+
+			switch (line[pos]) {
+			case '(':
+				pair_pos[pos] = string::npos;
+				parens.push_back(pos);
+				break;
+			case '{':
+				pair_pos[pos] = string::npos;
+				braces.push_back(pos);
+				break;
+			case ')':
+				if (!parens.empty()) {
+					pair_pos[parens.back()] = pos;
+					parens.pop_back();
+				}
+				break;
+			case '}':
+				if (!braces.empty()) {
+					pair_pos[braces.back()] = pos;
+					braces.pop_back();
+				}
+				break;
+			case '@':
+				mark_end = pos + 1;
+				if (((pos + 1) < line.size())
+				    && isdigit(line[pos + 1]))
+					text_end = pos + 1;
+				break;
+			}
+		}
+
+		built = true;
+	}
+
+	/* Per thread, as handles may convert on several threads at once */
+	static __thread line_pairs *current;
+	const string &line;
+	line_pairs *prev;
+	/* Closing position of every unescaped opener, npos if none */
+	vector<size_t> pair_pos;
+	/* One past the last unescaped "@" and "@<digit>" */
+	size_t mark_end, text_end;
+	bool built;
+};
+
+__thread line_pairs *line_pairs::current(nullptr);
+
+struct closed_by {
+	line_pairs::kind_t kind;
+
+	bool operator()(const bx::ssub_match &m) const
+	{
+		return line_pairs::closed(m.first, kind);
+	}
+};
+
+struct paired_impl {
+	typedef bool result_type;
+
+	bool operator()(const bx::ssub_match &o, const bx::ssub_match &c) const
+	{
+		return line_pairs::paired(o.first, c.first);
+	}
+};
+
+static const bx::function<paired_impl>::type paired = {{}};
+
+/* Linear with a "line_pairs" table in scope: an opener is rejected at once
+ * or its pair is found in a single pass, without recursion.
+ */
+static const bx::sregex &brace_expr()
+{
+	static const bx::sregex expr(
+		(bx::s1 = ~bx::after('\\') >> '{')
+		[bx::check(closed_by{line_pairs::GROUP})]
+		>> -*bx::_
+		>> (~bx::after('\\') >> '}')[bx::check(paired(bx::s1, bx::_))]
+	);
+
+	return expr;
+}
+
+static const bx::sregex &paren_expr()
+{
+	static const bx::sregex expr(
+		(bx::s1 = ~bx::after('\\') >> '(')
+		[bx::check(closed_by{line_pairs::GROUP})]
+		>> -*bx::_
+		>> (~bx::after('\\') >> ')')[bx::check(paired(bx::s1, bx::_))]
+	);
+
+	return expr;
+}
 
+/* Fields separated by unescaped commas; with "parens" set, the commas of
+ * balanced parentheses do not separate. By hand, as a repeated expression
+ * recurses on every character and runs out of stack on long lines.
+ */
 template <typename pair_t>
 static void split_csv(vector<string> &out, const pair_t &in,
-		      const bx::sregex &expr = csv_simple_expr)
+		      bool parens = false)
 {
-	bx::sregex_iterator b(in.first, in.second, expr), e;
+	const string s(in.first, in.second);
+	vector<size_t> close(parens ? s.size() : 0, string::npos), open;
+
+	for (size_t pos(0); parens && (pos < s.size()); ++pos) {
+		if (pos && (s[pos - 1] == '\\'))
+			continue;
+
+		if (s[pos] == '(')
+			open.push_back(pos);
+		else if ((s[pos] == ')') && !open.empty()) {
+			close[open.back()] = pos;
+			open.pop_back();
+		}
+	}
+
+	size_t f_pos(0);
+
+	for (size_t pos(0); pos < s.size(); ++pos) {
+		if (pos && (s[pos - 1] == '\\'))
+			continue;
+
+		if (parens && (close[pos] != string::npos))
+			pos = close[pos];
+		else if (s[pos] == ',') {
+			out.push_back(s.substr(f_pos, pos - f_pos));
+			f_pos = pos + 1;
+		}
+	}
 
-	for (; b != e; ++b)
-		out.push_back(b->str(1));
+	out.push_back(s.substr(f_pos));
 }
 
+static const char *space_chars(" \t\n\v\f\r");
+
+/* '<a href="target">text</a>' gives the target and the text, anything else
+ * a trimmed target alone. Done by hand, as an expression has to backtrack
+ * over every "href", quote and ">" of the line; the choices are the same
+ * and each is made once:
+ *  - the first "href =" the rest can follow;
+ *  - a quoted target ends at the first unescaped quote before the last ">"
+ *    which has a "</a>" after it, an unquoted one at the first space (not
+ *    escaped) or that ">";
+ *  - the text lies between the next ">" and "</a>".
+ */
 template <typename pair_t>
 static void parse_href(vector<string> &out, const pair_t &in)
 {
-	static const bx::sregex href_expr(
-		bx::bos >> *bx::_s >> "<a" >> +bx::_s >> -*bx::_ >> "href"
-			>> *bx::_s >> '=' >> *bx::_s
-			>> ((~bx::after('\\') >> '"' >> (bx::s1 = -*bx::_)
-			     >> ~bx::after('\\') >> '"')
-			    | (bx::s1 = *(~bx::_s
-					  | (bx::after('\\') >> bx::_s))))
-			>> -*bx::_ >> '>' >> *bx::_s >> (bx::s2 = -*bx::_)
-			>> *bx::_s >> "</a>" >> *bx::_
-	);
+	const string s(in.first, in.second);
+	size_t a_pos(s.rfind("</a>")), g_max(string::npos);
+	size_t p(s.find_first_not_of(space_chars));
 
-	bx::smatch what;
+	if ((a_pos != string::npos) && a_pos)
+		g_max = s.rfind('>', a_pos - 1);
 
-	if (!regex_match(in.first, in.second, what, href_expr))
+	if ((g_max == string::npos) || (p == string::npos)
+	    || s.compare(p, 2, "<a") || ((p + 2) >= s.size())
+	    || !isspace(s[p + 2])) {
 		out.push_back(trim(in));
-	else {
-		out.push_back(what.str(1));
-		out.push_back(what.str(2));
+		return;
 	}
 
-}
+	for (auto h(s.find("href", p + 3)); h != string::npos;
+	     h = s.find("href", h + 1)) {
+		auto v(s.find_first_not_of(space_chars, h + 4));
 
-static void null_comment(function<void (const string &)>  out,
-			 const vector<string> &in)
-{
-}
+		if ((v == string::npos) || (s[v] != '='))
+			continue;
 
-static void c_comment(function<void (const string &)>  out,
-		      const vector<string> &in)
-{
-	if (in.size() == 1)
-		out("/* " + in[0] + "*/");
-	else if (in.size() > 1) {
-		out("/*");
-		BOOST_FOREACH(const string &s, in) {
-			if (!s.empty())
-				out(" * " + s);
-			else
-				out(" *" + s);
+		v = min(s.find_first_not_of(space_chars, v + 1), s.size());
+		if (v > g_max)
+			break;
+
+		size_t t_b(v), t_e(v), next(v);
+
+		if (s[v] == '"') {
+			for (t_e = v + 1; t_e < g_max; ++t_e) {
+				if ((s[t_e] == '"') && (s[t_e - 1] != '\\'))
+					break;
+			}
+
+			if (t_e < g_max) {
+				t_b = v + 1;
+				next = t_e + 1;
+			}
+		}
+
+		if (next == v) {
+			for (t_e = v; (t_e < g_max)
+			     && (!isspace(s[t_e]) || (s[t_e - 1] == '\\'));
+			     ++t_e);
+
+			next = t_e;
 		}
-		out(" */");
+
+		auto x_b(min(s.find_first_not_of(space_chars,
+						  s.find('>', next) + 1),
+			      s.size()));
+		auto x_e(s.find("</a>", x_b));
+
+		while ((x_e > x_b) && isspace(s[x_e - 1]))
+			--x_e;
+
+		out.push_back(s.substr(t_b, t_e - t_b));
+		out.push_back(s.substr(x_b, x_e - x_b));
+		return;
 	}
+
+	out.push_back(trim(in));
 }
 
-static void null_textref(function<void (const string &)>  out,
-			 const string &name, unsigned int pos)
+/* "* name :: description", by hand for the same reason as parse_href(): the
+ * name ends at the first "::" (spaces before it dropped), though it is never
+ * empty; the description is trimmed.
+ */
+static bool parse_menu_line(const string &line, string &name, string &desc)
 {
+	auto p(line.find_first_not_of(space_chars));
+
+	if ((p == string::npos) || (line[p] != '*'))
+		return false;
+
+	auto n_b(line.find_first_not_of(space_chars, p + 1)), n_e(n_b);
+
+	if (n_b == string::npos)
+		return false;
+
+	auto d_b(line.find("::", n_b + 1));
+
+	if (d_b != string::npos) {
+		for (n_e = d_b; (n_e > (n_b + 1)) && isspace(line[n_e - 1]);
+		     --n_e);
+	} else if ((n_b > (p + 1)) && !line.compare(n_b, 2, "::"))
+		d_b = n_b--;
+	else
+		return false;
+
+	d_b = min(line.find_first_not_of(space_chars, d_b + 2), line.size());
+
+	auto d_e(line.find_last_not_of(space_chars) + 1);
+
+	name = line.substr(n_b, n_e - n_b);
+	desc = line.substr(d_b, max(d_e, d_b) - d_b);
+	return true;
 }
 
-static void c_textref(function<void (const string &)>  out,
-		      const string &name, unsigned int pos)
-{
-	out((boost::format("#line %1% \"%2%\"") % pos % name).str());
+/* Comment and source reference formatting policies for generated targets.
+ * "out" is any callable taking a single output line.
+ */
+struct null_lang {
+	template <typename out_t>
+	static void comment(out_t &out, const vector<string> &in) {}
+
+	template <typename out_t>
+	static void textref(out_t &out, const string &name, unsigned int pos) {}
+};
+
+/* C headers */
+struct c_lang : public null_lang {
+	template <typename out_t>
+	static void comment(out_t &out, const vector<string> &in) {
+		if (in.size() == 1)
+			out("/* " + in[0] + "*/");
+		else if (in.size() > 1) {
+			out("/*");
+			BOOST_FOREACH(const string &s, in) {
+				if (!s.empty())
+					out(" * " + s);
+				else
+					out(" *" + s);
+			}
+			out(" */");
+		}
+	}
 };
 
-typedef function<void (function<void (const string &)>,
-		       const vector<string>&)> comment_formatter_t;
-typedef function<void (function<void (const string &)>,
-		       const string&, unsigned int)> textref_formatter_t;
+/* C sources, pointing the compiler back at the MX lines */
+struct c_src_lang : public c_lang {
+	template <typename out_t>
+	static void textref(out_t &out, const string &name, unsigned int pos) {
+		out((boost::format("#line %1% \"%2%\"") % pos % name).str());
+	}
+
+	/* "name" is left alone if the directive does not specify one */
+	static bool parse_textref(const string &line, string &name,
+				  unsigned int &pos) {
+		static const bx::sregex line_expr(
+			bx::bos >> *bx::_s >> '#' >> *bx::_s >> "line"
+				>> +bx::_s >> (bx::s1 = +bx::_d)
+				>> !(+bx::_s >> '"'
+				     >> (bx::s2 = *~bx::as_xpr('"')) >> '"')
+				>> *bx::_s >> bx::eos
+		);
+		auto p(line.find_first_not_of(" \t"));
+		bx::smatch what;
+
+		if ((p == string::npos) || (line[p] != '#')
+		    || !bx::regex_match(line, what, line_expr))
+			return false;
+
+		pos = boost::lexical_cast<unsigned int>(what[1]);
+		if (what[2].matched)
+			name = what[2];
+
+		return true;
+	}
+};
 
-static const map<string, comment_formatter_t> comment_formatters {
-	{"c", c_comment},
-	{"h", c_comment}
+/* Python and shell scripts */
+struct script_lang : public null_lang {
+	template <typename out_t>
+	static void comment(out_t &out, const vector<string> &in) {
+		BOOST_FOREACH(const string &s, in) {
+			if (!s.empty())
+				out("# " + s);
+			else
+				out("#");
+		}
+	}
 };
 
-static const map<string, textref_formatter_t> textref_formatters {
-	{"c", c_textref}
+enum lang_t {
+	NULL_LANG = 0,
+	C_LANG,
+	C_SRC_LANG,
+	SCRIPT_LANG
 };
 
+/* A constant table, nothing to build at startup */
+static const struct {
+	const char *tag;
+	lang_t lang;
+} target_langs[] = {
+	{"c", C_SRC_LANG},
+	{"cpp", C_SRC_LANG},
+	{"h", C_LANG},
+	{"hpp", C_LANG},
+	{"py", SCRIPT_LANG},
+	{"sh", SCRIPT_LANG}
+};
 
 /* A simplistic one. */
 template <typename pair_t>
@@ -204,180 +547,1264 @@ static size_t find_print_length(const pair_t &in)
 	return rv;
 }
 
-struct target {
-	struct line_mark {
-		target *t;
-		__gnu_cxx::crope::iterator begin;
-		__gnu_cxx::crope::iterator end;
-		unsigned int src_pos;
-		string padding;
-		unsigned int line_num;
-
-		line_mark(target *t_, const string &line, unsigned int src_pos_)
-		: t(t_),
-		  begin(t->body.mutable_end()),
-		  src_pos(src_pos_),
-		  padding(t->padding),
-		  line_num(t->line_cnt) {
-			t->add_line(line);
-			end = t->body.mutable_end();
-		}
-	};
+/* Receives the warnings of a conversion, one message at a time, without a
+ * line end (library use).
+ */
+typedef function<void (const string &)> warn_fn;
 
-	struct line_ref {
-		target *t;
-		__gnu_cxx::crope::iterator begin;
-		__gnu_cxx::crope::iterator end;
-		string padding;
-		string tag;
-		pair <size_t, size_t> lines;
-		function<string (size_t, size_t)> editor;
-
-		line_ref(target *t_, const string &tag_,
-			 function<string (size_t, size_t)> editor_,
-			 size_t s, size_t e)
-		: t(t_),
-		  begin(t->body.mutable_end()),
-		  padding(t->padding),
-		  tag(tag_),
-		  lines(s, e),
-		  editor(editor_) {
-			t->add_line(editor(s, e));
-			end = t->body.mutable_end();
+/* Collects a single warning, handing it over to "sink" when complete */
+struct warning : public ostringstream {
+	const warn_fn &sink;
+
+	warning(const warn_fn &sink_) : sink(sink_) {}
+
+	~warning() {
+		if (sink)
+			sink(str());
+	}
+};
+
+/* Creates a new uniquely named file next to "path", so that it can later be
+ * renamed over it. The file gets the mode of "path", if that exists, and
+ * the usual one of a new file, with the umask applied by open(), otherwise.
+ */
+static string make_temp_file(const bf::path &path)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz"
+				    "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	static __thread unsigned int seed;
+	struct stat st;
+	bool keep_mode(!stat(path.file_string().c_str(), &st));
+
+	if (!seed)
+		seed = time(nullptr) ^ (getpid() << 16)
+		       ^ reinterpret_cast<uintptr_t>(&seed);
+
+	for (int tries(0); tries < 100; ++tries) {
+		string suffix(6, '\0');
+
+		for (auto c = suffix.begin(); c != suffix.end(); ++c)
+			*c = chars[rand_r(&seed) % (sizeof(chars) - 1)];
+
+		string t_name((path.parent_path() / (".mx2sphinx." + suffix))
+			      .file_string());
+		int fd(open(t_name.c_str(),
+			    O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666));
+
+		if (fd < 0) {
+			if (errno == EEXIST)
+				continue;
+
+			return string();
 		}
-	};
 
-	__gnu_cxx::crope body;
-	string padding;
-	unsigned int line_cnt;
-	vector< boost::variant<line_mark, line_ref> > line_marks;
-	map<size_t, size_t> line_exp;
-	comment_formatter_t comment_formatter;
-	textref_formatter_t textref_formatter;
+		if (keep_mode)
+			fchmod(fd, st.st_mode & 07777);
 
-	target(const string &tag = string())
-	: line_cnt(0),
-	  comment_formatter(null_comment),
-	  textref_formatter(null_textref) {
+		close(fd);
+		return t_name;
+	}
+
+	return string();
+}
+
+/* Temporary file, removed along with its last holder unless released once
+ * renamed into place; so that a failed conversion leaves none behind.
+ */
+struct temp_file {
+	bf::path name;
 
-		auto c_iter(comment_formatters.find(tag));
-		if (c_iter != comment_formatters.end())
-			comment_formatter = c_iter->second;
+	temp_file(const bf::path &name_)
+	: name(name_) {}
 
-		auto t_iter(textref_formatters.find(tag));
-		if (t_iter != textref_formatters.end())
-			textref_formatter = t_iter->second;
+	~temp_file() {
+		if (!name.empty())
+			unlink(name.file_string().c_str());
 	}
 
-	void set_indent(unsigned int indent = 0) {
-		padding = pad_string(indent);
+	void release() {
+		name = bf::path();
 	}
+};
 
-	void add_line(const string &line = string()) {
-		if (!line.empty()) {
-			body += padding.c_str();
-			body += line.c_str();
-		}
+/* Whether the file at "path" already holds exactly the given content */
+static bool same_content(const bf::path &path, const __gnu_cxx::crope &data)
+{
+	if (!bf::exists(path) || (bf::file_size(path) != data.size()))
+		return false;
 
-		body += '\n';
-		++line_cnt;
+	ifstream ifile(path.file_string().c_str(), ios::binary);
+	vector<char> f_buf(1 << 16), d_buf(f_buf.size());
+	size_t pos(0);
+
+	while (ifile.read(&f_buf[0], f_buf.size()) || ifile.gcount()) {
+		size_t len(ifile.gcount());
+
+		if ((pos + len) > data.size())
+			return false;
+
+		data.copy(pos, len, &d_buf[0]);
+		if (memcmp(&f_buf[0], &d_buf[0], len))
+			return false;
+
+		pos += len;
 	}
 
-	void add_line_mark(const string &line, unsigned int src_pos) {
-		line_marks.push_back(line_mark(this, line, src_pos));
+	return pos == data.size();
+}
 
-		line_exp.insert(make_pair(line_cnt, 1));
+static bool same_content(const bf::path &path, const bf::path &other)
+{
+	if (!bf::exists(path)
+	    || (bf::file_size(path) != bf::file_size(other)))
+		return false;
+
+	ifstream ifile(path.file_string().c_str(), ios::binary);
+	ifstream ofile(other.file_string().c_str(), ios::binary);
+	vector<char> f_buf(1 << 16), o_buf(f_buf.size());
+
+	while (ifile.read(&f_buf[0], f_buf.size()) || ifile.gcount()) {
+		size_t len(ifile.gcount());
+
+		if (!ofile.read(&o_buf[0], len)
+		    || memcmp(&f_buf[0], &o_buf[0], len))
+			return false;
+	}
+
+	return true;
+}
+
+/* Files are only touched if their content changes; new content is
+ * renamed into place, so readers never see partially written output.
+ */
+static void write_file(const bf::path &path, const __gnu_cxx::crope &data,
+		       const warn_fn &warn)
+{
+	if (same_content(path, data))
+		return;
+
+	string t_name(make_temp_file(path));
+
+	if (t_name.empty()) {
+		warning(warn) << "couldn't create temporary file for " << path
+			      << " - skipping.";
+		return;
+	}
+
+	ofstream ofile(t_name.c_str(), ios::binary);
+
+	ofile << data;
+	ofile.close();
+
+	if (ofile.fail()
+	    || std::rename(t_name.c_str(), path.file_string().c_str())) {
+		warning(warn) << "couldn't write " << path << " - skipping.";
+		unlink(t_name.c_str());
 	}
+}
 
-	void add_line_ref(const string &tag,
-			  function<string (size_t, size_t)> editor,
-			  size_t s, size_t e) {
-		line_marks.push_back(line_ref(this, tag, editor, s, e));
+/* Output stream over a caller supplied file descriptor */
+struct fd_ostream : public ostream {
+	__gnu_cxx::stdio_filebuf<char> buf;
+
+	fd_ostream(int fd)
+	: ostream(0),
+	  buf(dup(fd), ios::out | ios::binary) {
+		if (!buf.is_open())
+			throw runtime_error((boost::format("couldn't use file "
+							   "descriptor %1%")
+					     % fd).str());
+		rdbuf(&buf);
 	}
 };
 
-struct mx_context {
-	typedef function<void (mx_context*, const string &line)> tag_handler_t;
-	typedef pair<string, unsigned int> macro_line_t;
-	typedef list<macro_line_t> line_block_t;
+/* Output stream handing its data over to a caller supplied function */
+struct callback_ostream : public ostream {
+	struct buf_t : public streambuf {
+		function<void (const char *, size_t)> f;
+		vector<char> data;
 
-	struct macro_t {
-		line_block_t lines;
-		string f_name;
-		unsigned int b_pos, e_pos;
-	};
+		buf_t(function<void (const char *, size_t)> f_)
+		: f(f_), data(1 << 16) {
+			setp(&data[0], &data[0] + data.size());
+		}
 
-	enum sec_level_t {
-		TITLE_LVL = 0,
-		MODULE_LVL,
-		SECT_LVL,
-		SUBSECT_LVL,
-		PAR_LVL
-	};
+		int overflow(int c) {
+			sync();
 
-	enum tag_level_t {
-		GEN_MARK_TAG = 0,
-		DOC_MARK_TAG,
-		SUB_BLK_TAG,
-		MACRO_REF_TAG,
-		MACRO_ARG_TAG,
-	};
+			if (c != traits_type::eof()) {
+				*pptr() = c;
+				pbump(1);
+			}
 
-	struct in_file {
-		bf::path name;
-		string base_name;
-		unsigned int line_cnt;
-		ifstream s;
+			return traits_type::not_eof(c);
+		}
 
-		in_file(bf::path name_)
-		: name(name_),
-		  base_name(bf::path(name.filename()).replace_extension()
-						     .file_string()),
-		  line_cnt(0),
-		  s(name.file_string().c_str(), ios::binary) {}
+		int sync() {
+			if (pptr() > pbase())
+				f(pbase(), pptr() - pbase());
 
-		string location() {
-			return (boost::format("%1%:%2%")
-				% name.file_string() % line_cnt).str();
+			setp(&data[0], &data[0] + data.size());
+			return 0;
 		}
-	};
+	} buf;
 
-	static map<string, mx_context::tag_handler_t> mx_tags;
-	static map<string, mx_context::tag_handler_t> mx_item_tags;
-	static map<string, mx_context::tag_handler_t> info_formatters;
-	static vector<char> sec_heads;
-	static const bx::sregex doc_mark_expr, text_mark_expr, sub_blk_expr,
-				macro_ref_expr, macro_arg_expr, dead_macro_expr,
-				gen_mark_expr, tag_class_expr, doc_tag_expr;
-	static const bx::placeholder<tag_level_t> tag_class;
+	callback_ostream(function<void (const char *, size_t)> f)
+	: ostream(0), buf(f) {
+		rdbuf(&buf);
+	}
 
-	boost::ptr_vector<in_file> in;
-	string ref_name;
-	map<string, target> out_files;
-	decltype(out_files.begin()) doc_iter, t_iter;
-	stack< pair<string, tag_handler_t> > envs;
-	boost::optional<tag_handler_t> auto_end;
-	unsigned int end_pos;
-	vector<bf::path> includes;
-	set<string> defines;
-	stack< pair<string, unsigned int> > prefixes;
-	int min_sec_lvl, abs_sec_lvl, rel_sec_lvl;
-	int image_cnt;
-	bool modulename_set;
-	macro_line_t saved_line;
-	vector<string> info_lines, extra_lines;
+	~callback_ostream() {
+		buf.pubsync();
+	}
+};
 
-	map<string, macro_t> macros;
-	decltype(macros.begin()) c_macro;
+/* Anonymous temporary file, holding spilled parts of target bodies. */
+struct spill_file {
+	int fd;
+	off_t size;
+
+	spill_file()
+	: fd(-1),
+	  size(0) {
+		const char *t_dir(getenv("TMPDIR"));
+		string t_name((bf::path(t_dir ? t_dir : "/tmp")
+			       / "mx2sphinx.XXXXXX").file_string());
+
+		fd = mkstemp(&t_name[0]);
+		if (fd < 0)
+			throw runtime_error((boost::format("couldn't create "
+							   "temporary file %1%")
+					     % t_name).str());
+		unlink(t_name.c_str());
+	}
 
-	char get_level_head(sec_level_t lvl);
+	~spill_file() {
+		close(fd);
+	}
 
-	void comment(const string &line);
-	void info_block(const string &line);
-	void end_info_block(const string &line);
-	void basename(const string &line);
-	void macro_def(const string &line);
-	void end_macro_def(const string &tag);
+	void append(const char *buf, size_t len) {
+		while (len) {
+			ssize_t rv(pwrite(fd, buf, len, size));
+
+			if (rv <= 0)
+				throw runtime_error("couldn't write temporary "
+						    "file");
+
+			buf += rv;
+			len -= rv;
+			size += rv;
+		}
+	}
+
+	void read(char *buf, size_t len, off_t pos) const {
+		while (len) {
+			ssize_t rv(pread(fd, buf, len, pos));
+
+			if (rv <= 0)
+				throw runtime_error("couldn't read temporary "
+						    "file");
+
+			buf += rv;
+			len -= rv;
+			pos += rv;
+		}
+	}
+};
+
+/* Rope leaf, fetching its characters from the spill file on demand. */
+struct spill_chunk : public __gnu_cxx::char_producer<char> {
+	shared_ptr<spill_file> f;
+	off_t base;
+
+	spill_chunk(shared_ptr<spill_file> f_, off_t base_)
+	: f(f_),
+	  base(base_) {}
+
+	void operator()(size_t start_pos, size_t len, char *buffer) {
+		f->read(buffer, len, base + start_pos);
+	}
+};
+
+/* Heap bytes of a string (not counting the short string buffer) and of a
+ * std::map node.
+ */
+static size_t string_mem(const string &str)
+{
+	return str.capacity() > 15 ? str.capacity() + 1 : 0;
+}
+
+template <typename key_t, typename value_t>
+static size_t map_node_size()
+{
+	return sizeof(pair<const key_t, value_t>) + 4 * sizeof(void *);
+}
+
+struct target {
+	enum ref_kind_t {
+		LITINC_LINES = 0,
+		LITINC_HEAD,
+		LITINC_SECLINE
+	};
+
+	enum line_kind_t {
+		TEXT_LINE = 0,
+		/* Line with yet undefined macro references, to be expanded
+		 * again by the late pass.
+		 */
+		MACRO_LINE,
+		/* Line quoting a line range of another target; the range is
+		 * shifted by the late expansion of that target's lines.
+		 */
+		REF_LINE
+	};
+
+	/* Lines as parsed, kept as parallel arrays. The text of a line starts
+	 * at "begin" (an offset into "text", counting the part written out
+	 * already) and ends where the next line starts. "aux" is the source
+	 * line of macro lines and the "line_refs" index of reference lines.
+	 */
+	struct lines_t {
+		vector<size_t> begin;
+		vector<unsigned char> kind;
+		vector<unsigned int> padding, aux;
+
+		size_t size() const { return begin.size(); }
+
+		void push_back(size_t b, line_kind_t k, unsigned int p,
+			       unsigned int a) {
+			begin.push_back(b);
+			kind.push_back(k);
+			padding.push_back(p);
+			aux.push_back(a);
+		}
+
+		void pop_back() {
+			begin.pop_back();
+			kind.pop_back();
+			padding.pop_back();
+			aux.pop_back();
+		}
+
+		void erase_front(size_t cnt) {
+			begin.erase(begin.begin(), begin.begin() + cnt);
+			kind.erase(kind.begin(), kind.begin() + cnt);
+			padding.erase(padding.begin(), padding.begin() + cnt);
+			aux.erase(aux.begin(), aux.begin() + cnt);
+		}
+	};
+
+	struct line_refs_t {
+		vector< pair<size_t, size_t> > lines;
+		vector<unsigned int> tag, f_name;
+		vector<unsigned char> kind;
+		vector<char> header;
+
+		size_t size() const { return lines.size(); }
+	};
+
+	/* Line text, without paddings and line ends; "text_base" bytes and
+	 * "line_base" lines were written out already (streaming mode).
+	 */
+	__gnu_cxx::crope text;
+	size_t text_base;
+	unsigned int line_base;
+	lines_t lines;
+	line_refs_t line_refs;
+	/* Number of the first macro or reference line, if any */
+	size_t first_pending;
+	/* Size of the text written out so far */
+	size_t out_bytes;
+	string padding;
+	unsigned int pad_id;
+	unsigned int line_cnt;
+	/* Strings shared by the lines (paddings, target tags, file names) */
+	vector<string> atoms;
+	map<string, unsigned int> atom_ids;
+	/* Late expansion of macro lines, by line number */
+	map<size_t, __gnu_cxx::crope> expansions;
+	map<size_t, size_t> line_exp;
+	lang_t lang;
+	/* Already written out part of the target (streaming mode); "sink_file"
+	 * is empty, if the sink is the final destination.
+	 */
+	shared_ptr<temp_file> sink_file;
+	shared_ptr<ostream> sink;
+	/* Leading part of the text, which is backed by the spill file */
+	shared_ptr<spill_file> spill;
+	size_t spill_len;
+	/* Source position the compiler will assume for the next line (C
+	 * sources, 0 - unknown) and the number of the #line directive ending
+	 * the target, if any.
+	 */
+	string src_name;
+	unsigned int src_line;
+	size_t src_ref_pos;
+	/* Source file (atom) and line of every line, when tracked */
+	vector< pair<unsigned int, unsigned int> > src_pos;
+	/* Lines are only counted, their text is never needed (check mode) */
+	bool discard;
+
+	target(const string &tag = string())
+	: text_base(0),
+	  line_base(0),
+	  first_pending(string::npos),
+	  out_bytes(0),
+	  line_cnt(0),
+	  lang(NULL_LANG),
+	  spill_len(0),
+	  src_line(0),
+	  src_ref_pos(string::npos),
+	  discard(false) {
+
+		pad_id = atom(padding);
+
+		BOOST_FOREACH(auto const &l, target_langs) {
+			if (tag == l.tag)
+				lang = l.lang;
+		}
+	}
+
+	struct line_sink {
+		target &t;
+
+		line_sink(target &t_) : t(t_) {}
+
+		void operator()(const string &line) {
+			t.add_line(line);
+		}
+	};
+
+	template <typename out_t>
+	void comment(out_t &out, const vector<string> &in) const {
+		switch (lang) {
+		case C_LANG:
+		case C_SRC_LANG:
+			c_lang::comment(out, in);
+			break;
+		case SCRIPT_LANG:
+			script_lang::comment(out, in);
+			break;
+		default:
+			null_lang::comment(out, in);
+		};
+	}
+
+	template <typename out_t>
+	void textref(out_t &out, const string &name, unsigned int pos) const {
+		switch (lang) {
+		case C_SRC_LANG:
+			c_src_lang::textref(out, name, pos);
+			break;
+		default:
+			null_lang::textref(out, name, pos);
+		};
+	}
+
+	void set_indent(unsigned int indent = 0) {
+		padding = pad_string(indent);
+		pad_id = atom(padding);
+	}
+
+	void push_line(line_kind_t kind, const string &line,
+		       unsigned int aux = 0) {
+		lines.push_back(text_base + text.size(), kind, pad_id, aux);
+		text.append(line.data(), line.size());
+		++line_cnt;
+	}
+
+	void add_line(const string &line = string()) {
+		if (discard) {
+			++line_cnt;
+			return;
+		}
+
+		if ((lang == C_SRC_LANG) && !track_src_line(line))
+			return;
+
+		push_line(TEXT_LINE, line);
+	}
+
+	/* Plain text lines, each ending in a line feed, taken from [b, e) */
+	void add_lines(const char *b, const char *e) {
+		while (b != e) {
+			auto l_end(static_cast<const char *>(
+				memchr(b, '\n', e - b)
+			));
+
+			if (discard)
+				++line_cnt;
+			else if (lang == C_SRC_LANG)
+				add_line(string(b, l_end));
+			else {
+				lines.push_back(text_base + text.size(),
+						TEXT_LINE, pad_id, 0);
+				text.append(b, l_end - b);
+				++line_cnt;
+			}
+
+			b = l_end + 1;
+		}
+	}
+
+	/* Drops #line directives, which do not change the source position, and
+	 * replaces a directive immediately followed by another one.
+	 */
+	bool track_src_line(const string &line) {
+		string name(src_name);
+		unsigned int pos(0);
+
+		if (!c_src_lang::parse_textref(line, name, pos)) {
+			if (src_line)
+				++src_line;
+
+			src_ref_pos = string::npos;
+			return true;
+		}
+
+		if (src_line && (pos == src_line) && (name == src_name))
+			return false;
+
+		if (src_ref_pos != string::npos) {
+			size_t b(lines.begin.back() - text_base);
+
+			text.erase(b, text.size() - b);
+			spill_len = min(spill_len, b);
+			lines.pop_back();
+			--line_cnt;
+		}
+
+		src_name = name;
+		src_line = pos;
+		src_ref_pos = line_cnt;
+		return true;
+	}
+
+	/* Lines before this point belong to a range already referenced from
+	 * the documentation, so a trailing #line directive has to stay.
+	 */
+	void end_src_range() {
+		src_ref_pos = string::npos;
+	}
+
+	unsigned int atom(const string &s) {
+		auto iter(atom_ids.find(s));
+
+		if (iter != atom_ids.end())
+			return iter->second;
+
+		atoms.push_back(s);
+		return atom_ids.insert(make_pair(s, atoms.size() - 1))
+			       .first->second;
+	}
+
+	/* End of the text of line "pos" (relative to "line_base") */
+	size_t line_end(size_t pos) const {
+		return (pos + 1 < lines.size()) ? lines.begin[pos + 1]
+						: text_base + text.size();
+	}
+
+	string text_str(size_t b, size_t e) const {
+		string rv(e - b, 0);
+
+		if (e > b)
+			text.copy(b - text_base, e - b, &rv[0]);
+
+		return rv;
+	}
+
+	/* Line "pos" as originally parsed, with its padding */
+	string line_str(size_t pos) const {
+		string rv(text_str(lines.begin[pos], line_end(pos)));
+
+		return rv.empty() ? rv : atoms[lines.padding[pos]] + rv;
+	}
+
+	static string ref_line(ref_kind_t kind, const string &f_name,
+			       char header, size_t s, size_t e);
+
+	string ref_line(size_t pos, size_t s, size_t e) const {
+		return ref_line(ref_kind_t(line_refs.kind[pos]),
+				atoms[line_refs.f_name[pos]],
+				line_refs.header[pos], s, e);
+	}
+
+	void add_line_mark(const string &line, unsigned int src_pos) {
+		if (discard) {
+			++line_cnt;
+			return;
+		}
+
+		if ((lang == C_SRC_LANG) && !track_src_line(line))
+			return;
+
+		first_pending = min(first_pending, size_t(line_cnt));
+		push_line(MACRO_LINE, line, src_pos);
+		/* late expansion may bring in its own #line directives */
+		src_line = 0;
+
+		line_exp.insert(make_pair(line_cnt, 1));
+	}
+
+	/* References are only kept around if some line in the referenced
+	 * range may get expanded by the late pass.
+	 */
+	void add_line_ref(const target &r, const string &tag, ref_kind_t kind,
+			  const string &f_name, char header, size_t s,
+			  size_t e) {
+		if (r.line_exp.empty() || (r.line_exp.begin()->first > e)) {
+			add_line(ref_line(kind, f_name, header, s, e));
+			return;
+		}
+
+		line_refs.lines.push_back(make_pair(s, e));
+		line_refs.tag.push_back(atom(tag));
+		line_refs.f_name.push_back(atom(f_name));
+		line_refs.kind.push_back(kind);
+		line_refs.header.push_back(header);
+
+		string line(ref_line(kind, f_name, header, s, e));
+
+		if (lang == C_SRC_LANG)
+			track_src_line(line);
+
+		first_pending = min(first_pending, size_t(line_cnt));
+		push_line(REF_LINE, line, line_refs.size() - 1);
+	}
+
+	/* Number of lines no later pass can change anymore */
+	size_t final_lines() const {
+		size_t rv(lines.size());
+
+		if (first_pending != string::npos)
+			rv = min(rv, first_pending - line_base);
+
+		if (src_ref_pos != string::npos)
+			rv = min(rv, src_ref_pos - line_base);
+
+		return rv;
+	}
+
+	/* Approximate heap usage of the text kept in memory, the line arrays
+	 * and the late expansion results.
+	 */
+	size_t text_mem() const {
+		return text.size() - spill_len;
+	}
+
+	size_t lines_mem() const {
+		const line_refs_t &r(line_refs);
+
+		return lines.begin.capacity() * sizeof(size_t)
+		       + lines.kind.capacity()
+		       + (lines.padding.capacity() + lines.aux.capacity())
+			 * sizeof(unsigned int)
+		       + r.lines.capacity() * sizeof(pair<size_t, size_t>)
+		       + (r.tag.capacity() + r.f_name.capacity())
+			 * sizeof(unsigned int)
+		       + r.kind.capacity() + r.header.capacity();
+	}
+
+	size_t expansions_mem() const {
+		size_t rv(expansions.size()
+			  * map_node_size<size_t, __gnu_cxx::crope>());
+
+		for (auto x = expansions.begin(); x != expansions.end(); ++x)
+			rv += x->second.size();
+
+		return rv;
+	}
+
+	size_t line_exp_mem() const {
+		return line_exp.size() * map_node_size<size_t, size_t>();
+	}
+
+	/* Number of the line "out_line" of the rendered text comes from */
+	size_t rendered_line(size_t out_line) const {
+		size_t pos(0);
+
+		for (; pos < lines.size(); ++pos) {
+			size_t cnt(1);
+
+			if ((lines.kind[pos] == MACRO_LINE)
+			    && expansions.count(line_base + pos))
+				cnt = line_exp.find(line_base + pos)->second;
+
+			if (cnt > out_line)
+				break;
+
+			out_line -= cnt;
+		}
+
+		return pos;
+	}
+
+	string shifted_ref(size_t pos, const map<string, target> &all) const;
+	size_t render(ostream &out, size_t b, size_t e,
+		      const map<string, target> &all) const;
+
+	/* Write out the lines no pass can change anymore, once their text
+	 * grows larger than "limit", into a temporary file next to "path".
+	 */
+	void flush(const bf::path &path, size_t limit,
+		   const map<string, target> &all, const warn_fn &warn) {
+		size_t cnt(final_lines());
+		size_t len((cnt < lines.size() ? lines.begin[cnt]
+					       : text_base + text.size())
+			   - text_base);
+
+		if ((len + cnt) < limit)
+			return;
+
+		if (!sink) {
+			string t_name(make_temp_file(path));
+
+			if (t_name.empty()) {
+				warning(warn) << "couldn't create temporary "
+						 "file for " << path
+					      << " - not streaming.";
+				return;
+			}
+
+			sink_file.reset(new temp_file(t_name));
+			sink.reset(new ofstream(t_name.c_str(), ios::binary));
+		}
+
+		out_bytes += render(*sink, 0, cnt, all);
+		text.erase(0, len);
+		text_base += len;
+		spill_len -= min(len, spill_len);
+		lines.erase_front(cnt);
+		line_base += cnt;
+	}
+
+	/* Move the in-memory tail of the text to the spill file, once it
+	 * grows larger than "limit". Lines keep their offsets, as the text
+	 * length does not change.
+	 */
+	void spill_out(size_t limit) {
+		size_t len(text.size() - spill_len);
+
+		if (len < limit)
+			return;
+
+		if (!spill)
+			spill.reset(new spill_file());
+
+		/* Copied in pieces, so the tail is not held twice */
+		vector<char> buf(min(len, size_t(1) << 16));
+		off_t base(spill->size);
+
+		for (size_t pos(0); pos < len; pos += buf.size()) {
+			size_t cnt(min(buf.size(), len - pos));
+
+			text.copy(spill_len + pos, cnt, &buf[0]);
+			spill->append(&buf[0], cnt);
+		}
+
+		text = text.substr(0, spill_len)
+		       + __gnu_cxx::crope(new spill_chunk(spill, base), len,
+					  true);
+		spill_len += len;
+	}
+};
+
+/* Emits lines "b" to "e" (relative to "line_base"); macro lines are
+ * replaced by their late expansion, and references adjusted for the lines
+ * added or removed by the late expansion of the referenced target. Only
+ * reads the targets, so several of them can be emitted at once.
+ */
+size_t target::render(ostream &out, size_t b, size_t e,
+		      const map<string, target> &all) const
+{
+	const size_t batch(1 << 16);
+	string buf;
+	size_t rv(0);
+
+	while (b < e) {
+		/* Line text is copied out in batches, as it may be spilled */
+		size_t x_e(b + 1);
+
+		while ((x_e < e)
+		       && ((lines.begin[x_e] - lines.begin[b]) < batch))
+			++x_e;
+
+		size_t t_off(lines.begin[b]);
+		buf = text_str(t_off, line_end(x_e - 1));
+
+		for (; b < x_e; ++b) {
+			const char *l_text(buf.data() + lines.begin[b] - t_off);
+			size_t l_len(line_end(b) - lines.begin[b]);
+
+			if (lines.kind[b] == MACRO_LINE) {
+				auto x_iter(expansions.find(line_base + b));
+
+				if (x_iter != expansions.end()) {
+					out << x_iter->second;
+					rv += x_iter->second.size();
+					continue;
+				}
+			} else if (lines.kind[b] == REF_LINE) {
+				string r_line(shifted_ref(lines.aux[b], all));
+
+				if (!r_line.empty()) {
+					out << r_line << '\n';
+					rv += r_line.size() + 1;
+					continue;
+				}
+			}
+
+			if (l_len) {
+				out << atoms[lines.padding[b]];
+				out.write(l_text, l_len);
+				rv += atoms[lines.padding[b]].size() + l_len;
+			}
+			out << '\n';
+			++rv;
+		}
+	}
+
+	return rv;
+}
+
+/* Reference "pos" with the line range shifted by the late expansion of the
+ * referenced target; empty, if the range did not change.
+ */
+string target::shifted_ref(size_t pos, const map<string, target> &all) const
+{
+	auto r_tgt(all.find(atoms[line_refs.tag[pos]]));
+
+	if (r_tgt == all.end())
+		return string();
+
+	auto const &l(line_refs.lines[pos]);
+	auto p(r_tgt->second.line_exp.begin());
+	auto q(r_tgt->second.line_exp.upper_bound(l.first));
+	auto r(r_tgt->second.line_exp.upper_bound(l.second));
+
+	int delta(0);
+	for (; p != q; ++p) {
+		if (!p->second) {
+			if (delta)
+				--delta;
+		} else if (p->second > 1)
+			delta += p->second - 1;
+	}
+	size_t start(l.first + delta);
+	int x_delta(delta);
+
+	for (; p != r; ++p) {
+		if (!p->second) {
+			if (delta)
+				--delta;
+		} else if (p->second > 1)
+			delta += p->second - 1;
+	}
+	size_t end(l.second + delta);
+
+	if (delta || x_delta)
+		return ref_line(pos, start, end);
+
+	return string();
+}
+
+/* Read-only stream buffer over a string */
+struct mem_buf : public streambuf {
+	mem_buf(const string *data = 0) {
+		if (data) {
+			char *p(const_cast<char *>(data->data()));
+
+			setg(p, p, p + data->size());
+		}
+	}
+
+	size_t pos() const { return gptr() - eback(); }
+	void skip(size_t len) { gbump(len); }
+};
+
+struct macro_lib;
+struct mx_section;
+
+/* Sections of a document parsed last time, by the hash of their text */
+typedef multimap<size_t, shared_ptr<const mx_section> > section_log_t;
+
+/* Contents of the files read so far, and the macros defined by include
+ * files; kept between conversions (watch and server modes), so that
+ * unchanged includes need not be read and parsed again.
+ */
+struct file_cache {
+	/* Modification time (ns) and size of a file, -1 if missing */
+	typedef pair<long long, off_t> stamp_t;
+
+	struct entry_t {
+		shared_ptr<const string> data;
+		stamp_t stamp;
+	};
+
+	map<string, entry_t> files;
+	/* Caller supplied content, used instead of the actual file */
+	map<string, shared_ptr<const string> > overlays;
+	map<string, shared_ptr<macro_lib> > libs;
+	map<string, shared_ptr<section_log_t> > sections;
+	/* Caller supplied include lookup (library use): fills in the content
+	 * of the named file and returns true, if it has one.
+	 */
+	function<bool (const string &, string &)> resolver;
+
+	static stamp_t file_stamp(const string &name) {
+		struct stat st;
+
+		if (stat(name.c_str(), &st))
+			return stamp_t(-1, -1);
+
+		return stamp_t(st.st_mtim.tv_sec * 1000000000LL
+			       + st.st_mtim.tv_nsec, st.st_size);
+	}
+
+	/* Resolved files are told apart by the hash of their content */
+	stamp_t stamp(const string &name) {
+		string data;
+
+		if (resolver && resolver(name, data))
+			return stamp_t(hash<string>()(data),
+				       -2 - off_t(data.size()));
+
+		return file_stamp(name);
+	}
+
+	shared_ptr<const string> get(const bf::path &name) {
+		const string key(name.file_string());
+		auto o_iter(overlays.find(key));
+
+		if (o_iter != overlays.end())
+			return o_iter->second;
+
+		if (resolver) {
+			shared_ptr<string> data(new string());
+
+			if (resolver(key, *data))
+				return data;
+		}
+
+		stamp_t stamp(file_stamp(key));
+		auto iter(files.find(key));
+
+		if ((iter != files.end()) && (iter->second.stamp == stamp))
+			return iter->second.data;
+
+		ifstream ifile(key.c_str(), ios::binary);
+
+		if (!ifile.is_open()) {
+			files.erase(key);
+			return shared_ptr<const string>();
+		}
+
+		ostringstream data;
+		data << ifile.rdbuf();
+
+		entry_t &e(files[key]);
+		e.data.reset(new string(data.str()));
+		e.stamp = stamp;
+		return e.data;
+	}
+
+	shared_ptr<macro_lib> find_lib(const bf::path &name);
+	void invalidate(const bf::path &name);
+};
+
+/* Wall clock time, in seconds */
+static double mono_time()
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static string json_string(const string &str)
+{
+	string rv("\"");
+
+	BOOST_FOREACH(char c, str) {
+		if ((c == '"') || (c == '\\'))
+			rv += '\\';
+
+		if ((unsigned char)c < 0x20)
+			rv += (boost::format("\\u%04x") % int(c)).str();
+		else
+			rv += c;
+	}
+
+	return rv + '"';
+}
+
+/* Spans of the conversion steps, as Chrome trace events */
+struct trace_log {
+	double t_base;
+	ostringstream events;
+
+	trace_log() : t_base(mono_time()) {}
+
+	/* Times are as returned by mono_time() */
+	void span(const string &cat, const string &name, double b, double e) {
+		if (events.tellp())
+			events << ",\n";
+
+		events << boost::format("{\"name\": %s, \"cat\": \"%s\", "
+					"\"ph\": \"X\", \"ts\": %.3f, "
+					"\"dur\": %.3f, \"pid\": %d, "
+					"\"tid\": %d}")
+			  % json_string(name) % cat % ((b - t_base) * 1e6)
+			  % ((e - b) * 1e6) % getpid() % syscall(SYS_gettid);
+	}
+
+	string str() const {
+		return "{\"traceEvents\": [\n" + events.str()
+		       + "\n], \"displayTimeUnit\": \"ms\"}\n";
+	}
+};
+
+/* Where the time of a conversion went, and how much it processed */
+struct conv_stats {
+	string source;
+	/* Reading and parsing (without the first pass expansion), first
+	 * pass expansion, late expansion and target output (with reference
+	 * adjustment), in seconds
+	 */
+	double t_parse, t_expand, t_late, t_emit, t_total;
+	size_t lines, bytes_in, bytes_out;
+	size_t expansions, line_marks, line_refs, peak_size;
+
+	conv_stats(const string &source_ = string())
+	: source(source_), t_parse(0), t_expand(0), t_late(0), t_emit(0),
+	  t_total(0), lines(0), bytes_in(0), bytes_out(0), expansions(0),
+	  line_marks(0), line_refs(0), peak_size(0) {}
+
+	void add(const conv_stats &other) {
+		t_parse += other.t_parse;
+		t_expand += other.t_expand;
+		t_late += other.t_late;
+		t_emit += other.t_emit;
+		t_total += other.t_total;
+		lines += other.lines;
+		bytes_in += other.bytes_in;
+		bytes_out += other.bytes_out;
+		expansions += other.expansions;
+		line_marks += other.line_marks;
+		line_refs += other.line_refs;
+		peak_size = max(peak_size, other.peak_size);
+	}
+};
+
+/* Approximate memory held by the parts of a conversion ("macros", the
+ * include stack, the text, lines, expansions and line_exp of every target),
+ * with the largest size each reached and where.
+ */
+struct mem_stats {
+	struct item_t {
+		size_t size, peak;
+		string peak_at;
+
+		item_t() : size(0), peak(0) {}
+	};
+
+	string source;
+	map<string, item_t> items;
+
+	mem_stats(const string &source_ = string()) : source(source_) {}
+};
+
+/* Cost of the expansions of a single macro; the total time of a macro
+ * includes the expansion of the macros it references, the self time does
+ * not.
+ */
+struct macro_prof {
+	size_t calls, bytes, max_depth, forward_refs;
+	double t_total, t_self;
+
+	macro_prof()
+	: calls(0), bytes(0), max_depth(0), forward_refs(0), t_total(0),
+	  t_self(0) {}
+};
+
+/* Conversion settings, shared by all the sources of a run */
+struct mx_config {
+	/* Site specific tag handler: gives the text to add in place of the
+	 * tag line, or returns false for the generic tag handling.
+	 */
+	typedef function<bool (const string &line, string &text)> tag_fn;
+
+	string doc_tag;
+	vector<string> includes;
+	set<string> defines;
+	/* Targets go next to the source, if not set */
+	bf::path out_dir;
+	/* Named define sets, added to "defines"; every source is converted
+	 * once for each, into a subdirectory of the output directory.
+	 */
+	map<string, set<string> > configs;
+	size_t stream_size, spill_size;
+	/* Targets written directly to file descriptors, rather than files */
+	map<string, int> target_fds;
+	/* Handlers of tags none of the built-in ones match, by tag name */
+	map<string, tag_fn> site_tags;
+	file_cache *cache;
+	/* Receives the targets instead of files (library use) */
+	function<void (const string &, const char *, size_t)> output;
+	warn_fn warn;
+	/* Statistics of every conversion, if set */
+	vector<conv_stats> *stats;
+	/* Macro expansion profile, accumulated over conversions, if set */
+	map<string, macro_prof> *profile;
+	trace_log *trace;
+	/* Memory accounting of every conversion, if set */
+	vector<mem_stats> *mem;
+	/* Conversion path: the plain one (legacy), the one with the configured
+	 * caching, streaming and spilling (fast), or both, with the outputs
+	 * compared (diff).
+	 */
+	enum engine_t {
+		FAST_ENGINE,
+		LEGACY_ENGINE,
+		DIFF_ENGINE
+	} engine;
+	/* Output of the other engine to compare with (diff engine) */
+	string diff_dir;
+	/* Sources are only parsed and checked, nothing is written */
+	bool check;
+
+	mx_config()
+	: doc_tag("rst"),
+	  stream_size(0),
+	  spill_size(256 << 20),
+	  cache(0),
+	  stats(0),
+	  profile(0),
+	  trace(0),
+	  mem(0),
+	  engine(FAST_ENGINE),
+	  check(false) {}
+};
+
+struct mx_context {
+	typedef function<void (mx_context*, const string &line)> tag_handler_t;
+	typedef void (mx_context::*tag_method_t)(const string &line);
+	typedef pair<string, unsigned int> macro_line_t;
+	typedef list<macro_line_t> line_block_t;
+
+	struct macro_t {
+		line_block_t lines;
+		string f_name;
+		unsigned int b_pos, e_pos;
+	};
+
+	enum sec_level_t {
+		TITLE_LVL = 0,
+		MODULE_LVL,
+		SECT_LVL,
+		SUBSECT_LVL,
+		PAR_LVL
+	};
+
+	enum tag_level_t {
+		GEN_MARK_TAG = 0,
+		DOC_MARK_TAG,
+		SUB_BLK_TAG,
+		MACRO_REF_TAG,
+		MACRO_ARG_TAG,
+	};
+
+	struct in_file {
+		bf::path name;
+		string base_name;
+		unsigned int line_cnt;
+		shared_ptr<const string> data;
+		ifstream f;
+		mem_buf m;
+		istream s;
+		/* Time the parsing started, when traced */
+		double t_open;
+
+		in_file(bf::path name_)
+		: name(name_),
+		  base_name(bf::path(name.filename()).replace_extension()
+						     .file_string()),
+		  line_cnt(0),
+		  f(name.file_string().c_str(), ios::binary),
+		  s(f.rdbuf()),
+		  t_open(0) {}
+
+		/* Cached file content */
+		in_file(bf::path name_, shared_ptr<const string> data_)
+		: name(name_),
+		  base_name(bf::path(name.filename()).replace_extension()
+						     .file_string()),
+		  line_cnt(0),
+		  data(data_),
+		  m(data.get()),
+		  s(data ? static_cast<streambuf *>(&m) : f.rdbuf()),
+		  t_open(0) {}
+
+		/* Standard input */
+		in_file()
+		: name(bf::system_complete("stdin")),
+		  base_name("stdin"),
+		  line_cnt(0),
+		  s(cin.rdbuf()),
+		  t_open(0) {}
+
+		bool is_open() const {
+			return (s.rdbuf() != f.rdbuf()) || f.is_open();
+		}
+
+		string location() {
+			return (boost::format("%1%:%2%")
+				% name.file_string() % line_cnt).str();
+		}
+	};
+
+	static map<string, mx_context::tag_handler_t> info_formatters;
+	static const char sec_heads[];
+
+	/* Built on first use, a run pays only for the expressions it needs */
+	static const bx::sregex &doc_mark_expr();
+	static const bx::sregex &text_mark_expr();
+	static const bx::sregex &sub_blk_expr();
+	static const bx::sregex &macro_ref_expr();
+	static const bx::sregex &macro_arg_expr();
+	static const bx::sregex &dead_macro_expr();
+	static const bx::sregex &gen_mark_expr();
+	static const bx::sregex &tag_class_expr();
+	static const bx::sregex &doc_tag_expr();
+	static const bx::placeholder<tag_level_t> tag_class;
+
+	boost::ptr_vector<in_file> in;
+	string ref_name;
+	map<string, target> out_files;
+	decltype(out_files.begin()) doc_iter, t_iter;
+	stack< pair<string, tag_handler_t> > envs;
+	boost::optional<tag_handler_t> auto_end;
+	unsigned int end_pos;
+	vector<bf::path> includes;
+	set<string> defines;
+	stack< pair<string, unsigned int> > prefixes;
+	int min_sec_lvl, abs_sec_lvl, rel_sec_lvl;
+	int image_cnt;
+	bool modulename_set;
+	macro_line_t saved_line;
+	vector<string> info_lines, extra_lines;
+
+	map<string, macro_t> macros;
+	decltype(macros.begin()) c_macro;
+
+	char get_level_head(sec_level_t lvl);
+
+	void comment(const string &line);
+	void info_block(const string &line);
+	void end_info_block(const string &line);
+	void basename(const string &line);
+	void macro_def(const string &line);
+	void end_macro_def(const string &tag);
 	void include(const string &line);
 	void author(const string &line);
 	void version(const string &line);
@@ -420,1599 +1847,3971 @@ struct mx_context {
 	void item_itemize(const string &line);
 	void item_table(const string &line);
 
-	void generic_tag(const string &tag, const string &line);
-	void end_generic_tag(const string &tag);
+	static tag_method_t find_tag(const string &tag);
+	static tag_method_t find_item_tag(const string &env);
+
+	bool site_tag(const string &tag, const string &line);
+	void generic_tag(const string &tag, const string &line);
+	void end_generic_tag(const string &tag);
+
+	void expand_macros(line_block_t &out, const macro_line_t &in,
+			   const target &t, unsigned int indent = 0,
+			   unsigned int pass = 1);
+	string replace_doc_tags(const bx::smatch &what);
+	string replace_text_tags(const bx::smatch &what);
+
+	void parse_line_include(const string &line);
+	void parse_line_literal(const string &line);
+	void take_literal(size_t &l_cnt, size_t &b_cnt);
+	void parse_line_doc(const string &line);
+
+	void add_line_markup(const string &line);
+	void add_line_text(const string &line);
+	void add_line_expand(const string &line);
+	void add_line_macro(const string &line);
+	void add_line_menu(const string &line);
+	void add_line_asis(const string &line);
+	void add_line_info(const string &line);
+	void add_line_noop(const string &line);
+
+	void add_line_c_comment(const string &line);
+
+	tag_handler_t parse_line;
+	tag_handler_t add_line, add_line_prev;
+
+	void late_expand(target &t);
+	void mem_note(const string &item, size_t size, const string &where);
+	void mem_sample(const string &where = string());
+	void note_src();
+	size_t diff_out(const bf::path &ref_dir);
+	void fail(const string &msg);
+
+	bf::path out_prefix;
+	size_t stream_size, spill_size;
+	map<string, int> target_fds;
+	map<string, mx_config::tag_fn> site_tags;
+	file_cache *cache;
+	function<void (const string &, const char *, size_t)> output;
+	/* Warnings go to "warn_sink" through "warn", which keeps the ones
+	 * of the section being parsed
+	 */
+	warn_fn warn_sink, warn;
+	conv_stats *stats;
+	map<string, macro_prof> *profile;
+	trace_log *trace;
+	mem_stats *mem;
+	/* Target lines are mapped to the source (diff engine) */
+	bool track_src;
+	/* No targets are built; problems are counted instead of ending the
+	 * conversion, undefined macros are kept with their first reference.
+	 */
+	bool check;
+	unsigned int errors;
+	map<string, string> undefined;
+	/* Reported location of the undefined references, while the forward
+	 * references are checked
+	 */
+	string check_ref;
+	/* Size of the macro table, as of "mem_ver" macro version */
+	size_t mem_macros, mem_ver;
+	/* Time spent in the nested expansions of every macro being expanded */
+	vector<double> prof_nested;
+	/* Every file read by the conversion */
+	set<string> deps;
+
+	/* Include files being parsed, collecting their macros for reuse */
+	struct lib_rec_t {
+		bf::path name;
+		size_t depth;
+		bool valid;
+		set<string> macros;
+		map<string, file_cache::stamp_t> deps;
+	};
+	vector<lib_rec_t> lib_recs;
+
+	/* Parser state at a section boundary; a section parsed from the same
+	 * state and text gives the same output.
+	 */
+	struct sect_state_t {
+		struct target_t {
+			string tag, padding, src_name;
+			/* 0 for the documentation target */
+			unsigned int line_cnt, src_line;
+			size_t first_exp;
+
+			bool operator==(const target_t &other) const {
+				return tie(tag, padding, src_name, line_cnt,
+					   src_line, first_exp)
+				       == tie(other.tag, other.padding,
+					      other.src_name, other.line_cnt,
+					      other.src_line, other.first_exp);
+			}
+		};
+
+		tag_method_t add_line;
+		string base_name;
+		int min_sec_lvl, abs_sec_lvl, rel_sec_lvl, image_cnt;
+		bool modulename_set, ref_name_set;
+		unsigned int end_pos;
+		vector<string> info_lines;
+		vector<target_t> targets;
+
+		bool operator==(const sect_state_t &other) const {
+			return tie(add_line, base_name, min_sec_lvl,
+				   abs_sec_lvl, rel_sec_lvl, image_cnt, modulename_set,
+				   ref_name_set, end_pos, info_lines, targets)
+			       == tie(other.add_line, other.base_name,
+				      other.min_sec_lvl,
+				      other.abs_sec_lvl, other.rel_sec_lvl,
+				      other.image_cnt, other.modulename_set,
+				      other.ref_name_set, other.end_pos,
+				      other.info_lines, other.targets);
+		}
+	};
+
+	/* Section being parsed, since the last boundary */
+	struct sect_rec_t {
+		struct start_t {
+			size_t text, refs;
+			unsigned int line_cnt;
+		};
+
+		bool active;
+		size_t offset;
+		unsigned int line;
+		/* Output depends on the source line numbers */
+		bool line_dep;
+		sect_state_t state;
+		map<string, start_t> starts;
+		/* Macros defined by the section */
+		set<string> macros;
+		/* Macros looked up by the section, before it defined them, with
+		 * the hash of their definition at the time (0 - undefined)
+		 */
+		map<string, size_t> used;
+		map<string, file_cache::stamp_t> deps;
+		/* Flags tested, with their values */
+		map<string, bool> flags;
+		/* Warnings given, and problems counted, while parsing it */
+		vector<string> warnings;
+		unsigned int errors;
+
+		sect_rec_t() : active(false), errors(0) {}
+	};
+
+	/* Sum of the definition hashes of all macros (memory accounting) */
+	size_t macro_ver;
+	shared_ptr<const section_log_t> old_sects;
+	shared_ptr<section_log_t> new_sects;
+	sect_rec_t sect_rec;
+
+	static size_t macro_hash(const string &name, const macro_t &m);
+	static size_t macro_mem(const string &name, const macro_t &m);
+	void note_macro(const string &name);
+	void note_macro_use(const string &name);
+	void note_warning(const string &msg);
+	void note_flag(const string &name, bool set);
+	bool flags_match(const mx_section &sect) const;
+	bool sect_state(sect_state_t &st) const;
+	void checkpoint();
+	void finish_section();
+	bool replay_section(const sect_state_t &st);
+
+	in_file *open_file(const bf::path &name);
+	void note_dep(const bf::path &name);
+	bool include_lib(const bf::path &name);
+	void store_lib();
+	void include_note(const bf::path &name, const string &base_name);
+	void open_target(decltype(out_files.begin()) t);
+
+	mx_context(const string &source, const mx_config &cfg);
+	void write_out();
+};
+
+/* Macros defined by an include file, and the files they came from */
+struct macro_lib {
+	string base_name;
+	vector< pair<string, mx_context::macro_t> > macros;
+	map<string, file_cache::stamp_t> deps;
+};
+
+/* Output of a document section, spliced back in when a later conversion
+ * reaches the same text in the same parser state.
+ */
+struct mx_section {
+	struct output_t {
+		string tag;
+		__gnu_cxx::crope text;
+		unsigned int line_cnt;
+		/* Offsets are relative to the start of the section */
+		target::lines_t lines;
+		target::line_refs_t refs;
+		vector<string> atoms;
+		map<size_t, size_t> line_exp;
+	};
+
+	string text;
+	unsigned int line, lines;
+	bool line_dep;
+	mx_context::sect_state_t entry, exit;
+	string ref_name;
+	vector<output_t> outputs;
+	vector< pair<string, mx_context::macro_t> > macros;
+	/* The section is only valid with the same definitions of these */
+	map<string, size_t> used;
+	map<string, file_cache::stamp_t> deps;
+	/* The section is only valid under the same values of these */
+	map<string, bool> flags;
+	/* Given again, whenever the section is spliced back */
+	vector<string> warnings;
+	unsigned int errors;
+};
+
+shared_ptr<macro_lib> file_cache::find_lib(const bf::path &name)
+{
+	auto iter(libs.find(name.file_string()));
+
+	if (iter == libs.end())
+		return shared_ptr<macro_lib>();
+
+	BOOST_FOREACH(auto const &d, iter->second->deps) {
+		if (overlays.count(d.first)
+		    || (stamp(d.first) != d.second)) {
+			libs.erase(iter);
+			return shared_ptr<macro_lib>();
+		}
+	}
+
+	return iter->second;
+}
+
+void file_cache::invalidate(const bf::path &name)
+{
+	files.erase(name.file_string());
+
+	for (auto iter(libs.begin()); iter != libs.end();) {
+		if (iter->second->deps.count(name.file_string()))
+			libs.erase(iter++);
+		else
+			++iter;
+	}
+}
+
+/* Block tags are looked up by length and leading character first, so most
+ * lines are dispatched after a single string comparison.
+ */
+mx_context::tag_method_t mx_context::find_tag(const string &tag)
+{
+	switch (tag.size()) {
+	case 1:
+		switch (tag[0]) {
+		case '\'': return &mx_context::comment;
+		case '/': return &mx_context::info_block;
+		case 'f': return &mx_context::basename;
+		case '=': return &mx_context::macro_def;
+		case 'a': return &mx_context::author;
+		case 'v': return &mx_context::version;
+		case 'd': return &mx_context::date;
+		case 't': return &mx_context::title;
+		case '*': return &mx_context::module;
+		case '+': return &mx_context::section;
+		case '-': return &mx_context::paragraph;
+		case '{': return &mx_context::subblock;
+		case '}': return &mx_context::end_subblock;
+		case '(': return &mx_context::subblock1;
+		case ')': return &mx_context::end_subblock1;
+		case 'T': return &mx_context::qtex;
+		};
+		break;
+	case 3:
+		if (tag == "end")
+			return &mx_context::end;
+		else if (tag == "tab")
+			return &mx_context::tab;
+		else if (tag == "tex")
+			return &mx_context::tex;
+		break;
+	case 4:
+		if (tag == "node")
+			return &mx_context::node;
+		else if (tag == "menu")
+			return &mx_context::menu;
+		else if (tag == "item")
+			return &mx_context::item;
+		break;
+	case 5:
+		if (tag == "table")
+			return &mx_context::table;
+		else if (tag == "iftex")
+			return &mx_context::iftex;
+		else if (tag == "ifset")
+			return &mx_context::ifset;
+		break;
+	case 7:
+		switch (tag[0]) {
+		case 'i':
+			if (tag == "include")
+				return &mx_context::include;
+			else if (tag == "itemize")
+				return &mx_context::itemize;
+			else if (tag == "ifclear")
+				return &mx_context::ifclear;
+			break;
+		case 'e':
+			if (tag == "example")
+				return &mx_context::example;
+			break;
+		case 's':
+			if (tag == "section")
+				return &mx_context::section;
+			break;
+		};
+		break;
+	case 8:
+		if (tag == "noindent")
+			return &mx_context::noindent;
+		else if (tag == "verbatim")
+			return &mx_context::verbatim;
+		break;
+	case 9:
+		if (tag == "enumerate")
+			return &mx_context::enumerate;
+		break;
+	case 10:
+		if (tag == "subsection")
+			return &mx_context::subsection;
+		else if (tag == "multitable")
+			return &mx_context::multitable;
+		break;
+	};
+
+	return 0;
+}
+
+mx_context::tag_method_t mx_context::find_item_tag(const string &env)
+{
+	switch (env.size()) {
+	case 5:
+		if (env == "table")
+			return &mx_context::item_table;
+		break;
+	case 7:
+		if (env == "itemize")
+			return &mx_context::item_itemize;
+		break;
+	case 9:
+		if (env == "enumerate")
+			return &mx_context::item_itemize;
+		break;
+	case 10:
+		if (env == "multitable")
+			return &mx_context::item_table;
+		break;
+	};
+
+	return 0;
+}
+
+const char mx_context::sec_heads[] = {'#', '*', '=', '-', '^', '"'};
+
+/* Linear with a "line_pairs" table in scope: an opener without a closing
+ * mark or brace fails at once and the first closing one ends the match.
+ */
+const bx::sregex &mx_context::doc_mark_expr()
+{
+	static const bx::sregex expr(
+		'@' >> (((bx::s1 = (bx::set = '[', '%', '#', '`'))
+			 [bx::check(closed_by{line_pairs::MARK})]
+			 >> (bx::s2 = -*bx::_) >> ~bx::after('\\')
+			 >> '@' >> (bx::s4 = !bx::_d))
+			| ((((bx::s1 = 'e') >> "mph")
+			    | ("ci" >> (bx::s1 = 't') >> 'e')
+			    | ((bx::s1 = 's') >> "trong")
+			    | ((bx::s1 = 'v') >> "erb")
+			    | ((bx::s1 = 'u') >> "rl")
+			    | ((bx::s1 = 'i') >> "mage")
+			    | ('s' >> (bx::s1 = 'c'))
+			    | ('c' >> (bx::s1 = 'o') >> "de"))
+			   >> (bx::s2 = brace_expr()))) >> (bx::s3 = !bx::_s)
+	);
+
+	return expr;
+}
+
+const bx::sregex &mx_context::text_mark_expr()
+{
+	static const bx::sregex expr(
+		~bx::after('\\') >> '@'
+		>> (bx::s1 = '`')[bx::check(closed_by{line_pairs::TEXT_MARK})]
+		>> (bx::s2 = -*bx::_)
+		>> ~bx::after('\\') >> '@' >> (bx::s3 = bx::_d)
+	);
+
+	return expr;
+}
+
+const bx::sregex &mx_context::sub_blk_expr()
+{
+	static const bx::sregex expr(
+		'@' >> (bx::s1 = (bx::set = '{', '}', '(', ')'))
+	);
+
+	return expr;
+}
+
+/* Linear with a "line_pairs" table in scope: the name ends at the first
+ * "@", group or line end and the group fails at once, if not closed.
+ */
+const bx::sregex &mx_context::macro_ref_expr()
+{
+	static const bx::sregex expr(
+		"@:" >> (bx::s1 = -+bx::_)
+		     >> (((bx::s2 = paren_expr()) >> !(~bx::after('\\') >> '@'))
+			 | ((~bx::after('\\') >> '@')
+			    | (!((bx::s3 = '\\') >> bx::_s) >> bx::eos)))
+	);
+
+	return expr;
+}
+
+const bx::sregex &mx_context::macro_arg_expr()
+{
+	static const bx::sregex expr(
+		'@' >> !((bx::s3 = '?') >> '@')
+		    >> ((bx::s2 = bx::_d) | ('[' >> (bx::s2 = +bx::_d) >> ']'))
+	);
+
+	return expr;
+}
+
+const bx::sregex &mx_context::dead_macro_expr()
+{
+	static const bx::sregex expr(
+		"@!!" >> (bx::s1 = -+bx::_)
+		      >> ((bx::s2 = paren_expr()) >> !(~bx::after('\\') >> '@')
+			  | ((~bx::after('\\') >> '@') | bx::eos))
+	);
+
+	return expr;
+}
+
+/* Linear, the argument is trimmed like in trim() */
+const bx::sregex &mx_context::gen_mark_expr()
+{
+	static const bx::sregex expr(
+		bx::bos >> '@' >> (bx::s2 = *~bx::_s) >> *bx::_s
+			>> (bx::s3 = !(*bx::_ >> ~bx::_s)) >> *bx::_s >> bx::eos
+	);
+
+	return expr;
+}
+
+const bx::placeholder<mx_context::tag_level_t> mx_context::tag_class = {{}};
+
+const bx::sregex &mx_context::tag_class_expr()
+{
+	static const bx::sregex expr(
+		bx::bos >> *bx::_s
+			>> ((macro_arg_expr())[tag_class = MACRO_ARG_TAG]
+			    | (macro_ref_expr())[tag_class = MACRO_REF_TAG]
+			    | (doc_mark_expr())[tag_class = DOC_MARK_TAG]
+			    | (sub_blk_expr())[tag_class = SUB_BLK_TAG])
+	);
+
+	return expr;
+}
+
+const bx::sregex &mx_context::doc_tag_expr()
+{
+	static const bx::sregex expr(
+		macro_arg_expr() | doc_mark_expr()
+	);
+
+	return expr;
+}
+
+char mx_context::get_level_head(sec_level_t lvl)
+{
+	char rv;
+
+	if (min_sec_lvl == -1)
+		min_sec_lvl = lvl;
+
+	if (lvl > abs_sec_lvl) {
+		if (rel_sec_lvl < (sizeof(sec_heads) - 1))
+			++rel_sec_lvl;
+	} else if (lvl < abs_sec_lvl) {
+		rel_sec_lvl -= abs_sec_lvl - lvl;
+		if (rel_sec_lvl < min_sec_lvl)
+			rel_sec_lvl = min_sec_lvl;
+	}
+	abs_sec_lvl = lvl;
+	return sec_heads[rel_sec_lvl];
+}
+
+void mx_context::comment(const string &line)
+{
+	/* Comments are ignored */
+}
+
+void mx_context::info_block(const string &line)
+{
+	add_line = &mx_context::add_line_info;
+	auto_end = &mx_context::end_info_block;
+}
+
+void mx_context::end_info_block(const string &line)
+{
+	add_line = &mx_context::add_line_markup;
+	auto_end.reset();
+}
+
+void mx_context::basename(const string &line)
+{
+	if (!line.empty()) {
+		in.back().base_name = line;
+		/* sphinx will choke if there are multiple module lines */
+		if ((in.size() == 1) && !modulename_set) {
+			t_iter = doc_iter;
+			t_iter->second.add_line(".. module:: " + line);
+			t_iter->second.add_line();
+			modulename_set = true;
+		}
+	}
+}
+
+void mx_context::macro_def(const string &line)
+{
+	if (line.empty())
+		return;
+
+	note_macro_use(line);
+	c_macro = macros.find(line);
+
+	if (c_macro == macros.end())
+		c_macro = macros.insert(make_pair(line, macro_t())).first;
+	else {
+		warning(warn) << "macro " << line << " redefined at "
+			      << in.back().location();
+		macro_ver -= macro_hash(c_macro->first, c_macro->second);
+		c_macro->second.lines.clear();
+	}
+
+	c_macro->second.f_name = in.back().name.filename();
+	c_macro->second.b_pos = in.back().line_cnt + 1;
+
+	note_macro(line);
+	sect_rec.line_dep = true;
+
+	auto_end = &mx_context::end_macro_def;
+	add_line = &mx_context::add_line_macro;
+}
+
+static void unindent_lines(mx_context::line_block_t &m)
+{
+	static const bx::sregex leading_space_expr(
+		bx::bos >> (bx::s1 = +bx::_s)
+	);
+	bx::smatch what;
+	size_t min_off(0);
+	vector<unsigned int> pads;
+
+	BOOST_FOREACH(auto &s, m) {
+		pads.push_back(0);
+		if (bx::regex_search(s.first, what, leading_space_expr)) {
+			if (!what.suffix().length())
+				s.first.clear();
+			else {
+				auto c_off(find_print_length(what[1]));
+
+				if (min_off && (min_off > c_off))
+					min_off = c_off;
+				else if (!min_off)
+					min_off = c_off;
+
+				if (!min_off)
+					break;
+
+				pads.back() = c_off;
+				s.first.assign(what.suffix());
+			}
+		} else if (!s.first.empty()) {
+			min_off = 0;
+			break;
+		}
+	}
+
+	auto c_line(m.begin());
+
+	BOOST_FOREACH(unsigned int pad, pads) {
+		if (pad)
+			c_line->first.insert(0, pad_string(pad - min_off));
+
+		++c_line;
+	}
+}
+
+void mx_context::end_macro_def(const string &line)
+{
+	auto_end.reset();
+
+	if (in.size() == 1) {
+		t_iter = doc_iter;
+
+		string m_title("Macro: " + c_macro->first);
+		t_iter->second.add_line();
+		t_iter->second.add_line(m_title);
+		t_iter->second.add_line(string(m_title.size(),
+					get_level_head(SUBSECT_LVL)));
+		t_iter->second.add_line(".. code-block:: guess");
+		t_iter->second.add_line();
+		t_iter->second.set_indent(prefixes.empty()
+					  ? 3 : (prefixes.top().second + 3));
+
+		BOOST_FOREACH(const macro_line_t &s, c_macro->second.lines)
+			t_iter->second.add_line(s.first);
+
+		t_iter->second.set_indent(prefixes.empty()
+					  ? 0 : prefixes.top().second);
+		t_iter->second.add_line();
+		add_line = &mx_context::add_line_markup;
+	} else
+		add_line = &mx_context::add_line_noop;
+
+	c_macro->second.e_pos = in.back().line_cnt + 1;
+	unindent_lines(c_macro->second.lines);
+	macro_ver += macro_hash(c_macro->first, c_macro->second);
+	c_macro = macros.end();
+}
+
+void mx_context::include(const string &line)
+{
+	if (line.empty())
+		return;
+
+	BOOST_FOREACH(bf::path &p, includes) {
+		bf::path f(bf::system_complete(p / line));
+		double t_open(trace ? mono_time() : 0);
+
+		if ((cache && cache->resolver) || exists(p)) {
+			if (cache && include_lib(f)) {
+				if (trace)
+					trace->span("include",
+						    f.file_string()
+						    + " (cached)",
+						    t_open, mono_time());
+
+				add_line = &mx_context::add_line_noop;
+				return;
+			}
+
+			in.push_back(open_file(f));
+
+			if (in.back().is_open()) {
+				in.back().t_open = t_open;
+
+				if (cache) {
+					lib_recs.push_back(lib_rec_t());
+					lib_recs.back().name = f;
+					lib_recs.back().depth = in.size();
+					lib_recs.back().valid = true;
+					lib_recs.back().deps[f.file_string()]
+						= cache->stamp(f.file_string());
+				}
+
+				parse_line = &mx_context::parse_line_include;
+				add_line = &mx_context::add_line_noop;
+				return;
+			} else
+				in.pop_back();
+
+			/* Creating the file later on changes the outcome */
+			note_dep(f);
+		}
+	}
+
+	warning(warn) << "couldn't open include file " << line << " at "
+		      << in.back().location() << " - skipping.";
+	++errors;
+}
+
+void mx_context::author(const string &line)
+{
+	if (!line.empty()) {
+		t_iter = doc_iter;
+		t_iter->second.add_line(":Author: " + line);
+	}
+}
+
+void mx_context::version(const string &line)
+{
+	if (!line.empty()) {
+		t_iter = doc_iter;
+		t_iter->second.add_line(":Version: " + line);
+	}
+}
+
+void mx_context::date(const string &line)
+{
+	if (!line.empty()) {
+		t_iter = doc_iter;
+		t_iter->second.add_line(":Date: " + line);
+	}
+}
+
+void mx_context::noindent(const string &line)
+{
+	t_iter = doc_iter;
+	t_iter->second.add_line(line);
+}
+
+void mx_context::title(const string &line)
+{
+	if (!line.empty()) {
+		t_iter = doc_iter;
+		t_iter->second.add_line();
+		t_iter->second.add_line(line);
+		t_iter->second.add_line(string(line.size(),
+					       get_level_head(TITLE_LVL)));
+		if (ref_name.empty())
+			ref_name = line;
+	}
+}
+
+void mx_context::module(const string &line)
+{
+	if (!line.empty()) {
+		t_iter = doc_iter;
+		t_iter->second.add_line();
+		t_iter->second.add_line(line);
+		t_iter->second.add_line(string(line.size(),
+					       get_level_head(MODULE_LVL)));
+		if (ref_name.empty())
+			ref_name = line;
+	}
+}
+
+void mx_context::section(const string &line)
+{
+	if (!line.empty()) {
+		t_iter = doc_iter;
+		t_iter->second.add_line();
+		t_iter->second.add_line(line);
+		t_iter->second.add_line(string(line.size(),
+					       get_level_head(SECT_LVL)));
+	}
+}
+
+void mx_context::subsection(const string &line)
+{
+	if (!line.empty()) {
+		t_iter = doc_iter;
+		t_iter->second.add_line();
+		t_iter->second.add_line(line);
+		t_iter->second.add_line(string(line.size(),
+					       get_level_head(SUBSECT_LVL)));
+	}
+}
+
+void mx_context::paragraph(const string &line)
+{
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+
+	if (!line.empty()) {
+		t_iter->second.add_line(line);
+		t_iter->second.add_line(string(line.size(),
+					       get_level_head(PAR_LVL)));
+	} else
+		t_iter->second.add_line();
+}
+
+void mx_context::node(const string &line)
+{
+	vector<string> nodes;
+	split_csv(nodes, make_pair(line.begin(), line.end()));
+	bool e_line(false);
+
+	t_iter = doc_iter;
+
+	BOOST_FOREACH(const string &s, nodes) {
+		if (!s.empty()) {
+			if (!e_line) {
+				t_iter->second.add_line();
+				e_line = true;
+			}
+			t_iter->second.add_line((boost::format(".. _%1%:")
+						 % s).str());
+		}
+	}
+
+	if (e_line)
+		t_iter->second.add_line();
+}
+
+void mx_context::menu(const string &line)
+{
+	envs.push(make_pair("menu", &mx_context::end_menu));
+
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	parse_line = &mx_context::parse_line_literal;
+	add_line = &mx_context::add_line_menu;
+}
+
+void mx_context::end_menu(const string &line)
+{
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	t_iter->second.add_line();
+	add_line = &mx_context::add_line_markup;
+}
+
+void mx_context::example(const string &line)
+{
+	envs.push(make_pair("example", &mx_context::end_example));
+
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	t_iter->second.add_line(".. code-block:: guess");
+	t_iter->second.add_line();
+	parse_line = &mx_context::parse_line_literal;
+	add_line = &mx_context::add_line_asis;
+}
+
+void mx_context::end_example(const string &line)
+{
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	t_iter->second.add_line();
+	add_line = &mx_context::add_line_markup;
+}
+
+void mx_context::verbatim(const string &line)
+{
+	envs.push(make_pair("verbatim", &mx_context::end_verbatim));
+
+	t_iter = doc_iter;
+	t_iter->second.add_line("::");
+	t_iter->second.add_line();
+	t_iter->second.set_indent(prefixes.empty() ? 3
+						   : prefixes.top().second + 3);
+	parse_line = &mx_context::parse_line_literal;
+	add_line = &mx_context::add_line_asis;
+}
+
+void mx_context::end_verbatim(const string &line)
+{
+	t_iter = doc_iter;
+	t_iter->second.set_indent(prefixes.empty() ? 0 : prefixes.top().second);
+	t_iter->second.add_line();
+	t_iter->second.add_line();
+	add_line = &mx_context::add_line_markup;
+}
+
+void mx_context::itemize(const string &line)
+{
+	envs.push(make_pair("itemize", &mx_context::end_itemize));
+	unsigned int indent(prefixes.empty() ? 0 : prefixes.top().second
+						 + 3);
+
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	prefixes.push(make_pair("* ", indent));
+}
+
+void mx_context::enumerate(const string &line)
+{
+	envs.push(make_pair("enumerate", &mx_context::end_itemize));
+	unsigned int indent(prefixes.empty() ? 0 : prefixes.top().second
+						    + 3);
+
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	prefixes.push(make_pair("#. ", indent));
+}
+
+void mx_context::end_itemize(const string &line)
+{
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	prefixes.pop();
+
+	if (prefixes.empty())
+		t_iter->second.set_indent(0);
+	else
+		t_iter->second.set_indent(prefixes.top().second);
+}
+
+/* Handled as a definition list */
+void mx_context::table(const string &line)
+{
+	envs.push(make_pair("table", &mx_context::end_table));
+	unsigned int indent(prefixes.empty() ? 0 : prefixes.top().second
+						    + 3);
+
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	prefixes.push(make_pair(string(), indent));
+}
+
+void mx_context::end_table(const string &line)
+{
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	prefixes.pop();
+
+	if (prefixes.empty())
+		t_iter->second.set_indent(0);
+	else
+		t_iter->second.set_indent(prefixes.top().second);
+}
+
+void mx_context::multitable(const string &line)
+{
+	envs.push(make_pair("multitable", &mx_context::end_multitable));
+	unsigned int indent(prefixes.empty() ? 0 : prefixes.top().second
+						 + 3);
+
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	prefixes.push(make_pair(string(), indent));
+}
+
+void mx_context::end_multitable(const string &line)
+{
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	prefixes.pop();
+
+	if (prefixes.empty())
+		t_iter->second.set_indent(0);
+	else
+		t_iter->second.set_indent(prefixes.top().second);
+}
+
+void mx_context::end(const string &line)
+{
+	if (!line.empty()) {
+		if (envs.empty()
+		    || (line != envs.top().first)) {
+			fail((boost::format("unbalanced end tag %1% at %2%")
+			      % line % in.back().location()).str());
+			return;
+		}
+
+		envs.top().second(this, line);
+		envs.pop();
+	}
+}
+
+void mx_context::item(const string &line)
+{
+	tag_method_t handler(0);
+
+	if (envs.empty() || !(handler = find_item_tag(envs.top().first))) {
+		warning(warn) << "ignoring loose @item at "
+			      << in.back().location();
+		++errors;
+		return;
+	}
+
+	(this->*handler)(line);
+}
+
+void mx_context::tab(const string &line)
+{
+	if (envs.empty() || !find_item_tag(envs.top().first)) {
+		warning(warn) << "ignoring loose @tab at "
+			      << in.back().location();
+		++errors;
+		return;
+	}
+
+	add_line_markup(line);
+	t_iter->second.set_indent(prefixes.top().second + 6);
+}
+
+
+void mx_context::item_itemize(const string &line)
+{
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	t_iter->second.set_indent(prefixes.top().second);
+	add_line_markup(prefixes.top().first + line);
+	t_iter->second.set_indent(prefixes.top().second
+				  + prefixes.top().first.size());
+}
+
+void mx_context::item_table(const string &line)
+{
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	t_iter->second.set_indent(prefixes.top().second);
+	add_line_markup(prefixes.top().first + line);
+	t_iter->second.set_indent(prefixes.top().second + 3);
+}
+
+void mx_context::subblock(const string &line)
+{
+	envs.push(make_pair("{", &mx_context::end_subblock));
+}
+
+void mx_context::end_subblock(const string &line)
+{
+	if (envs.empty() || ("{" != envs.top().first)) {
+		warning(warn) << boost::format("unbalanced subblock end at "
+					       "%1% - ignoring.")
+				 % in.back().location();
+		++errors;
+	} else {
+		target::line_sink out(t_iter->second);
+
+		t_iter->second.textref(out, in.back().name.filename(),
+				       in.back().line_cnt + 1);
+		envs.pop();
+	}
+}
+
+void mx_context::subblock1(const string &line)
+{
+	envs.push(make_pair("(", &mx_context::end_subblock));
+	add_line_prev = add_line;
+	add_line = &mx_context::add_line_noop;
+}
+
+void mx_context::end_subblock1(const string &line)
+{
+	if (envs.empty() || ("(" != envs.top().first))
+		fail((boost::format("unbalanced subblock type 1 end at %1%.")
+		      % in.back().location()).str());
+	else {
+		envs.pop();
+		add_line = add_line_prev;
+	}
+}
+
+void mx_context::qtex(const string &line)
+{
+	t_iter = doc_iter;
+/*
+	t_iter->second.add_line("raw:: latex");
+	t_iter->second.add_line();
+	auto_end = &mx_context::end_qtex;
+*/
+}
+
+void mx_context::end_qtex(const string &tag)
+{
+/*
+	t_iter = doc_iter;
+	t_iter->second.add_line();
+	t_iter->second.add_line();
+	auto_end.reset();
+*/
+}
+
+void mx_context::tex(const string &line)
+{
+	/* Just ignore qtex tags as mostly misplaced */
+
+	envs.push(make_pair("tex", &mx_context::end_tex));
+
+	t_iter = doc_iter;
+}
+
+void mx_context::iftex(const string &line)
+{
+	/* Just ignore qtex tags as mostly misplaced */
+
+	envs.push(make_pair("iftex", &mx_context::end_tex));
+
+	t_iter = doc_iter;
+}
+
+void mx_context::end_tex(const string &line)
+{
+	t_iter = doc_iter;
+}
+
+void mx_context::ifset(const string &line)
+{
+	envs.push(make_pair("ifset", &mx_context::end_if));
+	t_iter = doc_iter;
+
+	auto iter(defines.find(line));
+	note_flag(line, iter != defines.end());
+
+	if (iter != defines.end()) {
+		parse_line = &mx_context::parse_line_doc;
+		add_line = &mx_context::add_line_markup;
+	} else {
+		parse_line = &mx_context::parse_line_literal;
+		add_line = &mx_context::add_line_noop;
+	}
+}
+
+void mx_context::ifclear(const string &line)
+{
+	envs.push(make_pair("ifclear", &mx_context::end_if));
+	t_iter = doc_iter;
+
+	auto iter(defines.find(line));
+	note_flag(line, iter != defines.end());
+
+	if (iter == defines.end()) {
+		parse_line = &mx_context::parse_line_doc;
+		add_line = &mx_context::add_line_markup;
+	} else {
+		parse_line = &mx_context::parse_line_literal;
+		add_line = &mx_context::add_line_noop;
+	}
+}
+
+void mx_context::end_if(const string &line)
+{
+	t_iter = doc_iter;
+	add_line = &mx_context::add_line_markup;
+}
+
+/* Site specific tags are consulted after the built-in ones, before falling
+ * back to the generic (target) tag handling; the lines of the text given by
+ * the handler are added in place of the tag line.
+ */
+bool mx_context::site_tag(const string &tag, const string &line)
+{
+	auto iter(site_tags.find(tag));
+	string text, t_line;
+
+	if ((iter == site_tags.end()) || !iter->second(line, text))
+		return false;
+
+	istringstream t_in(text);
+
+	while (std::getline(t_in, t_line))
+		add_line(this, t_line);
+
+	return true;
+}
+
+void mx_context::generic_tag(const string &tag, const string &line)
+{
+	// cerr << "gen tag: " << tag << " line: " << line << endl;
+
+	t_iter = out_files.find(tag);
+
+	if (t_iter == out_files.end()) {
+		t_iter = out_files.insert(make_pair(tag, target(tag)))
+				  .first;
+		open_target(t_iter);
+
+		if (!info_lines.empty()) {
+			target::line_sink out(t_iter->second);
+
+			t_iter->second.comment(out, info_lines);
+		}
+	}
+
+	t_iter->second.end_src_range();
+	end_pos = t_iter->second.line_cnt;
+	auto_end = &mx_context::end_generic_tag;
+	sect_rec.line_dep = true;
+	add_line = &mx_context::add_line_text;
+
+	target::line_sink out(t_iter->second);
+
+	t_iter->second.textref(out, in.back().name.filename(),
+			       line.empty() ? in.back().line_cnt + 1
+					    : in.back().line_cnt);
+
+	if (!line.empty())
+		add_line(this, line);
+}
+
+string target::ref_line(ref_kind_t kind, const string &f_name, char header,
+			size_t s, size_t e)
+{
+	switch (kind) {
+	case LITINC_LINES:
+		return (boost::format("   :lines: %1%-%2%") % s % e).str();
+	case LITINC_HEAD:
+		return (boost::format("%1%: %2% - %3%") % f_name % s % e).str();
+	case LITINC_SECLINE: {
+		size_t len((boost::format("%1%: %2% - %3%") % f_name % s % e)
+			   .str().size());
+		return string(len, header);
+	}
+	};
+
+	return string();
+}
+
+void mx_context::end_generic_tag(const string &tag)
+{
+	auto x_iter(t_iter);
+	auto c_pos(x_iter->second.line_cnt);
+
+	t_iter = doc_iter;
+
+	if (c_pos - end_pos) {
+		end_pos++;
+
+		string f_name((boost::format("%1%.%2%")
+			       % in.back().base_name % (*x_iter).first).str());
+
+		t_iter->second.add_line();
+		t_iter->second.add_line_ref(x_iter->second, (*x_iter).first,
+					    target::LITINC_HEAD, f_name, 0,
+					    end_pos, c_pos);
+		t_iter->second.add_line_ref(x_iter->second, (*x_iter).first,
+					    target::LITINC_SECLINE, f_name,
+					    get_level_head(SUBSECT_LVL),
+					    end_pos, c_pos);
+		t_iter->second.add_line(".. literalinclude:: " + f_name);
+		t_iter->second.add_line("   :language: guess");
+		t_iter->second.add_line_ref(x_iter->second, (*x_iter).first,
+					    target::LITINC_LINES, f_name, 0,
+					    end_pos, c_pos);
+		t_iter->second.add_line();
+	}
+
+	auto_end.reset();
+	parse_line = &mx_context::parse_line_doc;
+	add_line = &mx_context::add_line_markup;
+}
+
+string mx_context::replace_doc_tags(const bx::smatch &what)
+{
+	string sel((*what.nested_results().begin())[1]);
+	string val((*what.nested_results().begin())[2]);
+
+	if (sel.empty())
+		return what[0];
+
+	string tail((*what.nested_results().begin())[3]);
+	string num((*what.nested_results().begin())[4]);
+	string x_tail(tail.empty() ? string("\\ ") : tail);
+	vector<string> out;
+
+	if (!num.empty())
+		x_tail = "\\ " + num + tail;
+
+	switch (sel[0]) {
+	case 'v': // @verb, @sc, @code
+	case 'c':
+	case 'o':
+		return (boost::format("``%1%``%2%")
+			% trim(make_pair(val.begin() + 1, val.end() - 1))
+			% x_tail).str();
+	case '`': { // code
+		int i_num(0);
+
+		if (!num.empty())
+			x_tail = tail.empty() ? string("\\ ") : tail;
+
+		warning(warn) << "index " << num << " entry at "
+			      << in.back().location() << " - ignored.";
+
+		return (boost::format("``%1%``%2%")
+			% trim(make_pair(val.begin(), val.end()))
+			% x_tail).str();
+	}
+	case '%': // emph
+		return (boost::format("*%1%*%2%")
+			% trim(make_pair(val.begin(), val.end()))
+			% x_tail).str();
+	case 'e': // @emph
+		return (boost::format("*%1%*%2%")
+			% trim(make_pair(val.begin() + 1, val.end() - 1))
+			% x_tail).str();
+	case '#': // strong
+		return (boost::format("**%1%**%2%")
+			% trim(make_pair(val.begin(), val.end()))
+			% x_tail).str();
+	case 's': // @strong
+		return (boost::format("**%1%**%2%")
+			% trim(make_pair(val.begin() + 1, val.end() - 1))
+			% x_tail).str();
+	case 't': // @cite
+		return (boost::format("[%1%]_%2%")
+			% trim(make_pair(val.begin() + 1, val.end() - 1))
+			% tail).str();
+	case '[': // link
+		parse_href(out, make_pair(val.begin(), val.end()));
+		if (out.empty())
+			return num + tail;
+		// deliberate fall-through
+	case 'u': // @url
+		if (out.empty())
+			split_csv(out, make_pair(val.begin() + 1,
+						 val.end() - 1));
+
+		switch (out.size()) {
+		case 0:
+			return tail;
+		case 1:
+			return (boost::format("`<%1%>`_%2%") % out[0] % x_tail)
+				.str();
+		default:
+			return (boost::format("`%1%<%2%>`_%3%")
+				% out[1] % out[0] % x_tail).str();
+		}
+	case 'i': // @image
+		split_csv(out, make_pair(val.begin() + 1, val.end() - 1));
+
+		if (out.empty())
+			return tail;
+
+		extra_lines.push_back((boost::format(".. |image_%1%| image:: "
+						     "%2%.*")
+				       % image_cnt % out[0]).str());
+		return ((boost::format("|image_%1%|%2%")
+			 % (image_cnt++) % x_tail).str());
+	};
+
+	return what[0];
+}
+
+string mx_context::replace_text_tags(const bx::smatch &what)
+{
+	string sel(what[1]);
+
+	if (sel.empty())
+		return what[0];
+
+	if (sel[0] == '`') {
+		warning(warn) << boost::format("text index reference %1% at "
+					       "%2%) - ignored")
+				 % what[3] % in.back().location();
+		return what[2];
+	}
+
+	return what[0];
+}
+
+static string replace_macro_args(const vector<string> &args,
+				 const bx::smatch &what)
+{
+	auto p(boost::lexical_cast<unsigned int>(what[2]));
+
+	if (!what[3].length()) {
+		if (p < 1)
+			return what.str(0);
+		else if (p > args.size())
+			return string();
+		else
+			return args[p - 1];
+	} else {
+		if ((p < 1) || (p > args.size()) || args[p - 1].empty())
+			return "@!!";
+		else
+			return "@";
+	}
+}
+
+struct block_sink {
+	mx_context::line_block_t &out;
+	unsigned int indent;
+
+	block_sink(mx_context::line_block_t &out_, unsigned int indent_)
+	: out(out_),
+	  indent(indent_) {}
+
+	void operator()(const string &in) {
+		out.push_back(make_pair(in, 0));
+		out.push_back(make_pair(pad_string(indent), 0));
+	}
+};
+
+void mx_context::expand_macros(line_block_t &out, const macro_line_t &in,
+			       const target &t, unsigned int indent,
+			       unsigned int pass)
+{
+
+	macro_line_t m_line;
+	string::const_iterator b_iter, e_iter;
+	unsigned int line_pos;
+
+	if (!saved_line.first.empty()) {
+		m_line.first = saved_line.first + in.first;
+		saved_line.first.clear();
+		b_iter = m_line.first.begin();
+		e_iter = m_line.first.end();
+		line_pos = m_line.second;
+	} else {
+		b_iter = in.first.begin();
+		e_iter = in.first.end();
+		line_pos = in.second;
+	}
+
+	line_pairs pairs(m_line.first.empty() ? in.first : m_line.first);
+	bx::smatch what;
+	bx::sregex_iterator no_match;
+
+	if (out.empty())
+		out.push_back(make_pair(pad_string(indent), 0));
+
+	while (bx::regex_search(b_iter, e_iter, what, macro_ref_expr())) {
+		if (what.str(3) == "\\") {
+			saved_line = make_pair(what.str(1), line_pos);
+			return;
+		}
+
+		note_macro_use(what.str(1));
 
-	void expand_macros(line_block_t &out, const macro_line_t &in,
-			   const target &t, unsigned int indent = 0,
-			   unsigned int pass = 1);
-	string replace_doc_tags(const bx::smatch &what);
-	string replace_text_tags(const bx::smatch &what);
+		auto m_iter(macros.find(what.str(1)));
+		auto t_indent(find_print_length(what.prefix()));
+		out.back().first += what.prefix();
 
-	void parse_line_include(const string &line);
-	void parse_line_literal(const string &line);
-	void parse_line_doc(const string &line);
+		if (m_iter == macros.end()) {
+			if (check)
+				undefined.insert(make_pair(
+					what.str(1),
+					check_ref.empty()
+					? this->in.back().location()
+					: check_ref
+				));
+			else if (pass > 1)
+				warning(warn) << "pass " << pass
+					      << ": undefined macro "
+					      << what[1]
+					      << ", ignoring for now";
+
+			if ((pass == 1) && profile)
+				++(*profile)[what.str(1)].forward_refs;
 
-	void add_line_markup(const string &line);
-	void add_line_text(const string &line);
-	void add_line_expand(const string &line);
-	void add_line_macro(const string &line);
-	void add_line_menu(const string &line);
-	void add_line_asis(const string &line);
-	void add_line_info(const string &line);
-	void add_line_noop(const string &line);
+			out.back().first += what[0];
+			out.back().second = line_pos;
+		} else {
+			block_sink b_out(out, indent);
+			double t_start(0);
+			auto o_iter(--out.end());
+			size_t o_len(o_iter->first.size());
 
-	void add_line_c_comment(const string &line);
+			if (stats)
+				++stats->expansions;
+
+			if (profile) {
+				t_start = mono_time();
+				prof_nested.push_back(0);
+			}
+
+			t.textref(b_out, m_iter->second.f_name,
+				  m_iter->second.b_pos);
+
+			vector<string> m_vars;
+
+			if (what[2].length())
+				split_csv(
+					m_vars,
+					make_pair(what[2].first + 1,
+						  what[2].second - 1),
+					true
+				);
+#ifdef DEBUG_MACROS
+			cerr << "t |" << what[0] << "|" << endl;
+			cerr << "  m |" << what[1] << "|" << endl;
+			int x_cnt(0);
+			BOOST_FOREACH(const string &s, m_vars)
+				cerr << "   v " << x_cnt++ << " |" << s << "|"
+				     << endl;
+#endif
+			function< string (const bx::smatch&) > args_f(
+				bind(replace_macro_args, cref(m_vars),
+				     placeholders::_1));
+
+			BOOST_FOREACH(auto const &s, m_iter->second.lines) {
+				string m_out(bx::regex_replace(s.first,
+							       macro_arg_expr(),
+							       args_f));
+#ifdef DEBUG_MACROS
+				cerr << "m_out >>>" << m_out << endl;
+#endif
+				expand_macros(out, make_pair(m_out, s.second),
+					      t, indent + t_indent, pass);
+			}
+
+			t.textref(b_out, m_iter->second.f_name, line_pos);
+
+			if (profile) {
+				macro_prof &m_prof((*profile)[m_iter->first]);
+				double t_all(mono_time() - t_start);
+
+				++m_prof.calls;
+				m_prof.max_depth = max(m_prof.max_depth,
+						       prof_nested.size());
+				m_prof.t_total += t_all;
+				m_prof.t_self += t_all - prof_nested.back();
+				prof_nested.pop_back();
+
+				if (!prof_nested.empty())
+					prof_nested.back() += t_all;
+
+				for (; o_iter != out.end(); ++o_iter)
+					m_prof.bytes += o_iter->first.size();
+
+				m_prof.bytes -= o_len;
+			}
+		}
+		b_iter = what.suffix().first;
+	}
+	out.back().first.append(b_iter, e_iter);
+
+	string d_line;
+	{
+		line_pairs d_pairs(out.back().first);
+
+		d_line = bx::regex_replace(out.back().first, dead_macro_expr(),
+					   string());
+	}
+	out.back().first.swap(d_line);
+	out.push_back(make_pair(pad_string(indent), 0));
+}
+
+/* Problems with the structure of the document end the conversion; check
+ * runs report them all and go on.
+ */
+void mx_context::fail(const string &msg)
+{
+	if (!check)
+		throw runtime_error(msg);
+
+	warning(warn) << msg;
+	++errors;
+}
+
+void mx_context::late_expand(target &t)
+{
+	for (size_t pos(0); pos < t.lines.size(); ++pos) {
+		if (t.lines.kind[pos] != target::MACRO_LINE)
+			continue;
+
+		size_t line_num(t.line_base + pos);
+		line_block_t lines;
+
+		expand_macros(lines, make_pair(t.line_str(pos),
+					       t.lines.aux[pos]), t, 0, 2);
+
+		while (!lines.empty() && lines.back().first.empty())
+			lines.pop_back();
+
+		if (!lines.empty()) {
+			const string &padding(t.atoms[t.lines.padding[pos]]);
+			__gnu_cxx::crope &t_out(t.expansions[line_num]);
+
+			BOOST_FOREACH(auto const &s, lines) {
+				t_out += padding.c_str();
+				t_out += s.first.c_str();
+				t_out += "\n";
+			}
+
+			t.line_exp[line_num] = lines.size();
+		} else
+			t.line_exp[line_num] = 0;
+	}
+}
+
+void mx_context::mem_note(const string &item, size_t size,
+			  const string &where)
+{
+	mem_stats::item_t &m_item(mem->items[item]);
+
+	m_item.size = size;
+
+	if (size > m_item.peak) {
+		m_item.peak = size;
+		m_item.peak_at = where.empty() ? in.back().location() : where;
+	}
+}
+
+/* Updates the memory accounting; "where" defaults to the current source
+ * position.
+ */
+void mx_context::mem_sample(const string &where)
+{
+	size_t total(0), i_size(0);
+
+	/* The table only changes with the version, but for the macro being
+	 * defined.
+	 */
+	if (mem_ver != macro_ver) {
+		mem_macros = 0;
+
+		for (auto m = macros.begin(); m != macros.end(); ++m) {
+			if (m != c_macro)
+				mem_macros += macro_mem(m->first, m->second);
+		}
+
+		mem_ver = macro_ver;
+	}
+
+	total = mem_macros;
+
+	if (c_macro != macros.end())
+		total += macro_mem(c_macro->first, c_macro->second);
+
+	mem_note("macros", total, where);
+
+	BOOST_FOREACH(const in_file &f, in)
+		i_size += sizeof(in_file) + (f.data ? f.data->size() : 0);
+
+	mem_note("include stack", i_size, where);
+	total += i_size;
+
+	for (auto t = out_files.begin(); t != out_files.end(); ++t) {
+		const target &x(t->second);
+		const string prefix("target " + t->first + " ");
+
+		mem_note(prefix + "text", x.text_mem(), where);
+		mem_note(prefix + "lines", x.lines_mem(), where);
+		mem_note(prefix + "expansions", x.expansions_mem(), where);
+		mem_note(prefix + "line_exp", x.line_exp_mem(), where);
+		total += x.text_mem() + x.lines_mem() + x.expansions_mem()
+			 + x.line_exp_mem();
+	}
+
+	mem_note("total", total, where);
+}
+
+/* Attributes the target lines added since the last call to the current
+ * source line.
+ */
+void mx_context::note_src()
+{
+	for (auto t = out_files.begin(); t != out_files.end(); ++t) {
+		target &x(t->second);
+		size_t cnt(x.line_base + x.lines.size());
+
+		if (x.src_pos.size() < cnt)
+			x.src_pos.resize(cnt, make_pair(
+				x.atom(in.back().name.file_string()),
+				in.back().line_cnt
+			));
+		else
+			x.src_pos.resize(cnt);
+	}
+}
+
+void mx_context::add_line_markup(const string &line)
+{
+	line_pairs pairs(line);
+	string t_str(
+		bx::regex_replace(line, doc_tag_expr(),
+				  function<string (const bx::smatch&)>(
+					bind(&mx_context::replace_doc_tags,
+					     this, placeholders::_1)
+				  )
+		)
+	);
+
+	add_line_expand(t_str);
+
+	while(!extra_lines.empty()) {
+		t_iter->second.add_line(extra_lines.back());
+		extra_lines.pop_back();
+	}
+
+}
+
+void mx_context::add_line_text(const string &line)
+{
+	line_pairs pairs(line);
+	string t_str(
+		bx::regex_replace(line, text_mark_expr(),
+				  function<string (const bx::smatch&)>(
+					bind(&mx_context::replace_text_tags,
+					     this, placeholders::_1)
+				  )
+		)
+	);
+
+	add_line_expand(t_str);
+
+}
+
+void mx_context::add_line_expand(const string &line)
+{
+	line_block_t lines;
+	double t_start(stats ? mono_time() : 0);
+
+	expand_macros(lines, make_pair(line, in.back().line_cnt),
+		      t_iter->second);
+
+	if (stats)
+		stats->t_expand += mono_time() - t_start;
+
+	while (!lines.empty() && lines.back().first.empty())
+		lines.pop_back();
+
+	if (!lines.empty()) {
+		/* some macros can be defined after possible expansion */
+		BOOST_FOREACH(auto const &s, lines) {
+			if (s.second)
+				t_iter->second.add_line_mark(s.first, s.second);
+			else
+				t_iter->second.add_line(s.first);
+		}
+	} else
+		t_iter->second.add_line();
+}
+
+void mx_context::add_line_macro(const string &line)
+{
+	if (c_macro != macros.end())
+		c_macro->second.lines.push_back(
+			make_pair(line, in.back().line_cnt));
+}
+
+void mx_context::add_line_menu(const string &line)
+{
+	string name, desc;
+
+	if (parse_menu_line(line, name, desc))
+		t_iter->second.add_line((boost::format("* _`%1%`: %2%")
+					 % name % desc).str());
+}
+
+void mx_context::add_line_info(const string &line)
+{
+	info_lines.push_back(line);
+}
+
+void mx_context::add_line_asis(const string &line)
+{
+	t_iter->second.add_line(line);
+}
+
+void mx_context::add_line_noop(const string &line)
+{
+}
+
+/* Section boundaries are the top level title, module and section tags */
+static bool is_checkpoint(const char *b, const char *e)
+{
+	if ((b == e) || (*b != '@'))
+		return false;
+
+	const char *t(++b);
+
+	while ((t != e) && !isspace(*t))
+		++t;
+
+	if ((t - b) == 1)
+		return (*b == 't') || (*b == '*') || (*b == '+');
+
+	return string(b, t) == "section";
+}
+
+static bf::path find_relative(const bf::path &target, const bf::path &ref)
+{
+	bf::path rv;
+	auto t_iter(target.begin()), ref_iter(ref.begin());
+
+	do {
+		if ((*t_iter) != (*ref_iter))
+			break;
+		else {
+			++t_iter;
+			++ref_iter;
+		}
+	} while ((t_iter != target.end()) && (ref_iter != ref.end()));
+
+	for (; ref_iter != ref.end(); ++ref_iter)
+		rv /= "..";
+
+	for (; t_iter != target.end(); ++t_iter)
+		rv /= (*t_iter);
+
+	return rv;
+}
+
+/* Lines which may end a literal environment; others are taken as is */
+static bool is_literal_end(const char *b, const char *e)
+{
+	return ((e - b) >= 4) && !memcmp(b, "@end", 4)
+	       && ((e - b) == 4 || isspace(b[4]));
+}
+
+void mx_context::parse_line_literal(const string &line)
+{
+	bx::smatch what;
+
+	if (!is_literal_end(line.data(), line.data() + line.size())) {
+		add_line(this, line);
+		return;
+	}
+
+	if (bx::regex_match(line, what, gen_mark_expr())) {
+		if (!what[1].length() && (what.str(2) == "end")) {
+			if (envs.empty())
+				fail((boost::format("literal line in "
+						    "non-literal environment "
+						    "at %1%")
+				      % in.back().location()).str());
+			else if (what.str(3) == envs.top().first) {
+				envs.top().second(this, line);
+				envs.pop();
+				parse_line = &mx_context::parse_line_doc;
+				return;
+			}
+		}
+	}
+	add_line(this, line);
+}
 
-	tag_handler_t parse_line;
-	tag_handler_t add_line, add_line_prev;
+/* Takes the run of literal lines following the current one straight from
+ * the cached file content, up to the next line, which may end the
+ * environment or a section; disabled lines are dropped, "asis" ones go to
+ * the target in one go. Line positions are not tracked per line here, so
+ * the run is left to the line loop when they are.
+ */
+void mx_context::take_literal(size_t &l_cnt, size_t &b_cnt)
+{
+	in_file &f(in.back());
+	auto a_line(add_line.target<tag_method_t>());
 
-	struct late_expand : public boost::static_visitor<> {
-		mx_context &context;
-		size_t delta;
+	if (!f.data || track_src || mem || !a_line)
+		return;
 
-		late_expand(mx_context &context_)
-		: context(context_),
-		  delta(0) {}
+	const char *r_b(f.data->data() + f.m.pos());
+	const char *b(r_b), *e(f.data->data() + f.data->size());
+	bool sects(new_sects && (in.size() == 1));
 
-		void operator()(target::line_mark &m);
-		void operator()(target::line_ref &m) {
-			m.begin += delta;
-			m.end += delta;
-		}
-	};
+	while (b != e) {
+		auto l_end(static_cast<const char *>(memchr(b, '\n', e - b)));
 
-	struct ref_edit : public boost::static_visitor<> {
-		mx_context &context;
-		size_t delta;
-		ssize_t b_delta;
+		if (!l_end || is_literal_end(b, l_end)
+		    || (sects && is_checkpoint(b, l_end)))
+			break;
 
-		ref_edit(mx_context &context_)
-		: context(context_),
-		  delta(0),
-		  b_delta(0){}
+		if ((*a_line != &mx_context::add_line_noop)
+		    && (*a_line != &mx_context::add_line_asis))
+			(this->**a_line)(string(b, l_end));
 
-		void operator()(target::line_mark &m) {}
-		void operator()(target::line_ref &m);
-	};
+		++l_cnt;
+		b = l_end + 1;
+	}
 
-	mx_context(const vector<string> &includes_, const string &doc_tag,
-		   const set<string> &defines_);
-	void write_out(const bf::path &prefix);
-};
+	if (*a_line == &mx_context::add_line_asis)
+		t_iter->second.add_lines(r_b, b);
 
-map<string, mx_context::tag_handler_t> mx_context::mx_tags {
-	{"'", &mx_context::comment},
-	{"/", &mx_context::info_block},
-	{"f", &mx_context::basename},
-	{"=", &mx_context::macro_def},
-	{"include", &mx_context::include},
-	{"a", &mx_context::author},
-	{"v", &mx_context::version},
-	{"d", &mx_context::date},
-	{"noindent", &mx_context::noindent},
-	{"t", &mx_context::title},
-	{"*", &mx_context::module},
-	{"+", &mx_context::section},
-	{"section", &mx_context::section},
-	{"subsection", &mx_context::subsection},
-	{"-", &mx_context::paragraph},
-	{"node", &mx_context::node},
-	{"menu", &mx_context::menu},
-	{"example", &mx_context::example},
-	{"verbatim", &mx_context::verbatim},
-	{"itemize", &mx_context::itemize},
-	{"enumerate", &mx_context::enumerate},
-	{"table", &mx_context::table},
-	{"multitable", &mx_context::multitable},
-	{"end", &mx_context::end},
-	{"item", &mx_context::item},
-	{"tab", &mx_context::tab},
-	{"{", &mx_context::subblock},
-	{"}", &mx_context::end_subblock},
-	{"(", &mx_context::subblock1},
-	{")", &mx_context::end_subblock1},
-	{"T", &mx_context::qtex},
-	{"tex", &mx_context::tex},
-	{"iftex", &mx_context::iftex},
-	{"ifset", &mx_context::ifset},
-	{"ifclear", &mx_context::ifclear}
-};
+	b_cnt = b - r_b;
+	f.line_cnt += l_cnt;
+	f.m.skip(b_cnt);
+}
 
-map<string, mx_context::tag_handler_t> mx_context::mx_item_tags {
-	{"itemize", &mx_context::item_itemize},
-	{"enumerate", &mx_context::item_itemize},
-	{"table", &mx_context::item_table},
-	{"multitable", &mx_context::item_table}
-};
+void mx_context::parse_line_include(const string &line)
+{
+	static const bx::sregex inc_expr(bx::as_xpr('f') | '=' | "include");
 
-vector<char> mx_context::sec_heads{'#', '*', '=', '-', '^', '"'};
-
-const bx::sregex mx_context::doc_mark_expr(
-	'@' >> (((bx::s1 = (bx::set = '[', '%', '#', '`'))
-		 >> (bx::s2 = -*bx::_) >> ~bx::after('\\')
-		 >> '@' >> (bx::s4 = !bx::_d))
-		| ((((bx::s1 = 'e') >> "mph")
-		    | ("ci" >> (bx::s1 = 't') >> 'e')
-		    | ((bx::s1 = 's') >> "trong")
-		    | ((bx::s1 = 'v') >> "erb")
-		    | ((bx::s1 = 'u') >> "rl")
-		    | ((bx::s1 = 'i') >> "mage")
-		    | ('s' >> (bx::s1 = 'c'))
-		    | ('c' >> (bx::s1 = 'o') >> "de"))
-		   >> (bx::s2 = brace_expr))) >> (bx::s3 = !bx::_s)
-);
-
-const bx::sregex mx_context::text_mark_expr(
-	~bx::after('\\') >> '@' >> (bx::s1 = '`') >> (bx::s2 = -*bx::_)
-	>> ~bx::after('\\') >> '@' >> (bx::s3 = bx::_d)
-);
-
-const bx::sregex mx_context::sub_blk_expr(
-	'@' >> (bx::s1 = (bx::set = '{', '}', '(', ')'))
-);
-
-const bx::sregex mx_context::macro_ref_expr(
-	"@:" >> (bx::s1 = -+bx::_)
-	     >> (((bx::s2 = paren_expr) >> !(~bx::after('\\') >> '@'))
-		 | ((~bx::after('\\') >> '@')
-		    | (!((bx::s3 = '\\') >> bx::_s) >> bx::eos)))
-);
-
-const bx::sregex mx_context::macro_arg_expr(
-	'@' >> !((bx::s3 = '?') >> '@')
-	    >> ((bx::s2 = bx::_d) | ('[' >> (bx::s2 = +bx::_d) >> ']'))
-);
-
-const bx::sregex mx_context::dead_macro_expr(
-	"@!!" >> (bx::s1 = -+bx::_)
-	      >> ((bx::s2 = paren_expr) >> !(~bx::after('\\') >> '@')
-		  | ((~bx::after('\\') >> '@') | bx::eos))
-);
-
-const bx::sregex mx_context::gen_mark_expr(
-	bx::bos >> '@' >> (bx::s2 = *~bx::_s) >> *bx::_s
-		>> (bx::s3 = -*bx::_) >> *bx::_s >> bx::eos
-);
+	enum tag_level_t t_class(GEN_MARK_TAG);
+	bx::smatch what;
+	what.let(tag_class = t_class);
 
-const bx::placeholder<mx_context::tag_level_t> mx_context::tag_class = {{}};
+	if (bx::regex_match(line, what, gen_mark_expr())) {
+		string tag(what[2]);
+		if (regex_match(tag, inc_expr)) {
+			if (auto_end)
+				(*auto_end)(this, tag);
 
-const bx::sregex mx_context::tag_class_expr(
-	bx::bos >> *bx::_s >> ((macro_arg_expr)[tag_class = MACRO_ARG_TAG]
-			       | (macro_ref_expr)[tag_class = MACRO_REF_TAG]
-			       | (doc_mark_expr)[tag_class = DOC_MARK_TAG]
-			       | (sub_blk_expr)[tag_class = SUB_BLK_TAG])
-);
+			auto handler(find_tag(tag));
 
-const bx::sregex mx_context::doc_tag_expr(
-	macro_arg_expr | doc_mark_expr
-);
+			if (handler)
+				(this->*handler)(what.str(3));
 
-char mx_context::get_level_head(sec_level_t lvl)
-{
-	char rv;
+			return;
+		} else {
+			line_pairs pairs(line);
 
-	if (min_sec_lvl == -1)
-		min_sec_lvl = lvl;
+			if (!regex_search(line, what, tag_class_expr())) {
+				if (auto_end)
+					(*auto_end)(this, tag);
 
-	if (lvl > abs_sec_lvl) {
-		if (rel_sec_lvl < (sec_heads.size() - 1))
-			++rel_sec_lvl;
-	} else if (lvl < abs_sec_lvl) {
-		rel_sec_lvl -= abs_sec_lvl - lvl;
-		if (rel_sec_lvl < min_sec_lvl)
-			rel_sec_lvl = min_sec_lvl;
+				return;
+			} else if (t_class == SUB_BLK_TAG)
+				return;
+		}
 	}
-	abs_sec_lvl = lvl;
-	return sec_heads[rel_sec_lvl];
+	add_line(this, line);
 }
 
-void mx_context::comment(const string &line)
+void mx_context::parse_line_doc(const string &line)
 {
-	/* Comments are ignored */
-}
+	enum tag_level_t t_class(GEN_MARK_TAG);
+	bx::smatch what;
+	what.let(tag_class = t_class);
 
-void mx_context::info_block(const string &line)
-{
-	add_line = &mx_context::add_line_info;
-	auto_end = &mx_context::end_info_block;
-}
+	if (bx::regex_match(line, what, gen_mark_expr())) {
+		string tag(what[2]);
+		string arg(what[3]);
+		line_pairs pairs(line);
 
-void mx_context::end_info_block(const string &line)
-{
-	add_line = &mx_context::add_line_markup;
-	auto_end.reset();
-}
+		bx::regex_search(line, what, tag_class_expr());
 
-void mx_context::basename(const string &line)
-{
-	if (!line.empty()) {
-		in.back().base_name = line;
-		/* sphinx will choke if there are multiple module lines */
-		if ((in.size() == 1) && !modulename_set) {
-			t_iter = doc_iter;
-			t_iter->second.add_line(".. module:: " + line);
-			t_iter->second.add_line();
-			modulename_set = true;
+		if ((t_class == GEN_MARK_TAG) && auto_end)
+			(*auto_end)(this, tag);
+
+		if (tag.empty())
+			return;
+
+		if ((t_class == GEN_MARK_TAG) || (t_class == SUB_BLK_TAG)) {
+			auto handler(find_tag(tag));
+
+			if (handler)
+				(this->*handler)(arg);
+			else if (!site_tag(tag, arg))
+				generic_tag(tag, arg);
+
+			return;
 		}
 	}
+	add_line(this, line);
 }
 
-void mx_context::macro_def(const string &line)
+mx_context::mx_context(const string &source, const mx_config &cfg)
+	   :end_pos(0),
+	    doc_iter(out_files.insert(make_pair(cfg.doc_tag,
+						target(cfg.doc_tag))).first),
+	    t_iter(doc_iter),
+	    c_macro(macros.end()),
+	    includes(1, bf::path(source)),
+	    defines(cfg.defines),
+	    parse_line(&mx_context::parse_line_doc),
+	    add_line(&mx_context::add_line_markup),
+	    min_sec_lvl(-1),
+	    abs_sec_lvl(TITLE_LVL),
+	    rel_sec_lvl(TITLE_LVL),
+	    image_cnt(0),
+	    modulename_set(false),
+	    out_prefix(cfg.out_dir.empty() ? bf::path(source).parent_path()
+					   : cfg.out_dir),
+	    stream_size(cfg.stream_size),
+	    spill_size(cfg.spill_size),
+	    target_fds(cfg.target_fds),
+	    site_tags(cfg.site_tags),
+	    cache(cfg.cache),
+	    output(cfg.output),
+	    warn_sink(cfg.warn),
+	    warn(bind(&mx_context::note_warning, this, placeholders::_1)),
+	    stats(cfg.stats ? &cfg.stats->back() : 0),
+	    profile(cfg.profile),
+	    trace(cfg.trace),
+	    mem(cfg.mem ? &cfg.mem->back() : 0),
+	    track_src(!cfg.diff_dir.empty()),
+	    check(cfg.check),
+	    errors(0),
+	    mem_macros(0),
+	    mem_ver(0),
+	    macro_ver(0)
 {
-	if (line.empty())
-		return;
+	string t_str;
+	double t_start(stats ? mono_time() : 0);
 
-	c_macro = macros.find(line);
+	open_target(doc_iter);
 
-	if (c_macro == macros.end())
-		c_macro = macros.insert(make_pair(line, macro_t())).first;
-	else {
-		cerr << "macro " << line << " redefined at "
-		     << in.back().location() << endl;
-		c_macro->second.lines.clear();
+	/* The source's own directory is searched for includes first */
+	if (source == "-")
+		in.push_back(new in_file());
+	else
+		in.push_back(open_file(bf::system_complete(source)));
+
+	if (!in.front().is_open())
+		throw runtime_error((boost::format("couldn't access file %1%")
+				     % in.front().name).str());
+
+	includes[0].remove_filename();
+	includes.insert(includes.end(), cfg.includes.begin(),
+			cfg.includes.end());
+
+	/* Sections are only reused, when the whole text is kept in memory and
+	 * no site specific tag handler can give a different text for them.
+	 */
+	if (cache && !stream_size && !check && in.front().data
+	    && site_tags.empty()) {
+		auto &log(cache->sections[in.front().name.file_string()]);
+
+		old_sects = log;
+		new_sects.reset(new section_log_t());
+		checkpoint();
 	}
 
-	c_macro->second.f_name = in.back().name.filename();
-	c_macro->second.b_pos = in.back().line_cnt + 1;
+	while(true) {
+		while (!in.back().s.eof() && std::getline(in.back().s, t_str)) {
+			size_t l_cnt(0), b_cnt(0);
 
-	auto_end = &mx_context::end_macro_def;
-	add_line = &mx_context::add_line_macro;
-}
+			in.back().line_cnt++;
+			parse_line(this, t_str);
 
-static void unindent_lines(mx_context::line_block_t &m)
-{
-	static const bx::sregex leading_space_expr(
-		bx::bos >> (bx::s1 = +bx::_s)
-	);
-	bx::smatch what;
-	size_t min_off(0);
-	vector<unsigned int> pads;
+			auto p_line(parse_line.target<tag_method_t>());
 
-	BOOST_FOREACH(auto &s, m) {
-		pads.push_back(0);
-		if (bx::regex_search(s.first, what, leading_space_expr)) {
-			if (!what.suffix().length())
-				s.first.clear();
-			else {
-				auto c_off(find_print_length(what[1]));
+			if (p_line
+			    && (*p_line == &mx_context::parse_line_literal))
+				take_literal(l_cnt, b_cnt);
 
-				if (min_off && (min_off > c_off))
-					min_off = c_off;
-				else if (!min_off)
-					min_off = c_off;
+			if (track_src)
+				note_src();
 
-				if (!min_off)
-					break;
+			if (stats) {
+				stats->lines += 1 + l_cnt;
+				stats->bytes_in += t_str.size() + 1 + b_cnt;
 
-				pads.back() = c_off;
-				s.first.assign(what.suffix());
+				for (auto t = out_files.begin();
+				     t != out_files.end(); ++t)
+					stats->peak_size = max(
+						stats->peak_size,
+						t->second.text.size()
+					);
 			}
-		} else if (!s.first.empty()) {
-			min_off = 0;
+
+			if (mem)
+				mem_sample();
+
+			if (new_sects && (in.size() == 1)
+			    && is_checkpoint(t_str.data(),
+					     t_str.data() + t_str.size()))
+				checkpoint();
+
+			if (stream_size) {
+				for (auto t = out_files.begin();
+				     t != out_files.end(); ++t) {
+					auto x_path(out_prefix
+						    / in.front().base_name);
+
+					x_path.replace_extension(t->first);
+					t->second.flush(x_path, stream_size,
+							out_files, warn);
+				}
+			}
+
+			if (spill_size) {
+				for (auto t = out_files.begin();
+				     t != out_files.end(); ++t)
+					t->second.spill_out(spill_size);
+			}
+		}
+
+		if (new_sects && (in.size() == 1))
+			finish_section();
+
+		if (auto_end)
+			(*auto_end)(this, string());
+
+		if (track_src)
+			note_src();
+
+		if (in.size() == 2)
+			include_note(in[1].name, in[1].base_name);
+
+		if (!lib_recs.empty() && (lib_recs.back().depth == in.size()))
+			store_lib();
+
+		if (trace && (in.size() > 1))
+			trace->span("include", in.back().name.file_string(),
+				    in.back().t_open, mono_time());
+
+		if (in.size() > 1)
+			in.pop_back();
+		else
 			break;
+
+		if (in.size() == 1)
+			parse_line = &mx_context::parse_line_doc;
+	}
+
+	if (new_sects) {
+		/* Variants of the sections parsed under other flag values are
+		 * kept, while the same text is still there.
+		 */
+		if (old_sects) {
+			BOOST_FOREACH(auto const &s, *old_sects) {
+				if (new_sects->count(s.first)
+				    && !flags_match(*s.second))
+					new_sects->insert(s);
+			}
 		}
+
+		cache->sections[in.front().name.file_string()] = new_sects;
 	}
 
-	auto c_line(m.begin());
+	if (stats) {
+		stats->t_parse = mono_time() - t_start - stats->t_expand;
+		t_start = mono_time();
+	}
 
-	BOOST_FOREACH(unsigned int pad, pads) {
-		if (pad)
-			c_line->first.insert(0, pad_string(pad - min_off));
+	if (check) {
+		while (!envs.empty()) {
+			fail((boost::format("missing end tag %1% at the end "
+					    "of %2%")
+			      % envs.top().first
+			      % in.front().name.file_string()).str());
+			envs.pop();
+		}
 
-		++c_line;
+		/* The forward references were expanded by pass 1 only; expand
+		 * every one of them once more, into a scratch block, so that
+		 * references in the bodies of macros defined later are checked
+		 * as well.
+		 */
+		map<string, string> fwd(undefined);
+		target scratch;
+
+		scratch.discard = true;
+		BOOST_FOREACH(auto const &u, fwd) {
+			if (!macros.count(u.first))
+				continue;
+
+			line_block_t lines;
+
+			check_ref = (boost::format("%1% (in macro %2%)")
+				     % u.second % u.first).str();
+			expand_macros(lines, make_pair("@:" + u.first + "@",
+						       0u), scratch, 0, 2);
+			saved_line.first.clear();
+		}
+		check_ref.clear();
+
+		BOOST_FOREACH(auto const &u, undefined) {
+			if (!macros.count(u.first))
+				fail((boost::format("undefined macro %1% at "
+						    "%2%")
+				      % u.first % u.second).str());
+		}
+
+		return;
+	}
+
+	for (auto t = out_files.begin(); t != out_files.end(); ++t) {
+		double t_late(trace ? mono_time() : 0);
+
+		late_expand(t->second);
+
+		if (trace)
+			trace->span("pass", "late expansion of " + t->first,
+				    t_late, mono_time());
+
+		if (mem)
+			mem_sample("late expansion of " + t->first);
+	}
+
+	if (stats) {
+		stats->t_late = mono_time() - t_start;
+
+		for (auto t = out_files.begin(); t != out_files.end(); ++t) {
+			BOOST_FOREACH(unsigned char k, t->second.lines.kind) {
+				if (k == target::MACRO_LINE)
+					++stats->line_marks;
+				else if (k == target::REF_LINE)
+					++stats->line_refs;
+			}
+		}
 	}
+
 }
 
-void mx_context::end_macro_def(const string &line)
+mx_context::in_file *mx_context::open_file(const bf::path &name)
 {
-	auto_end.reset();
+	in_file *rv(cache ? new in_file(name, cache->get(name))
+			  : new in_file(name));
 
-	if (in.size() == 1) {
-		t_iter = doc_iter;
+	if (rv->is_open()) {
+		note_dep(name);
 
-		string m_title("Macro: " + c_macro->first);
-		t_iter->second.add_line();
-		t_iter->second.add_line(m_title);
-		t_iter->second.add_line(string(m_title.size(),
-					get_level_head(SUBSECT_LVL)));
-		t_iter->second.add_line(".. code-block:: guess");
-		t_iter->second.add_line();
-		t_iter->second.set_indent(prefixes.empty()
-					  ? 3 : (prefixes.top().second + 3));
+		BOOST_FOREACH(lib_rec_t &r, lib_recs) {
+			if (cache->overlays.count(name.file_string()))
+				r.valid = false;
+		}
+	}
 
-		BOOST_FOREACH(const macro_line_t &s, c_macro->second.lines)
-			t_iter->second.add_line(s.first);
+	return rv;
+}
 
-		t_iter->second.set_indent(prefixes.empty()
-					  ? 0 : prefixes.top().second);
-		t_iter->second.add_line();
-		add_line = &mx_context::add_line_markup;
-	} else
-		add_line = &mx_context::add_line_noop;
+/* Files missing now are recorded as well (with a "missing" stamp), so
+ * that their creation invalidates what was parsed without them.
+ */
+void mx_context::note_dep(const bf::path &name)
+{
+	deps.insert(name.file_string());
+
+	BOOST_FOREACH(lib_rec_t &r, lib_recs)
+		r.deps[name.file_string()] = cache->stamp(name.file_string());
+
+	if (sect_rec.active)
+		sect_rec.deps[name.file_string()]
+			= cache->stamp(name.file_string());
+}
+
+void mx_context::include_note(const bf::path &name, const string &base_name)
+{
+	t_iter = doc_iter;
+
+	bf::path rel_path(find_relative(name.parent_path().file_string(),
+					in[0].name.parent_path()
+					     .file_string()));
+
+	rel_path /= base_name;
+
+	t_iter->second.add_line();
+	t_iter->second.add_line((boost::format("Include :doc:`%1%`.")
+				 % rel_path.file_string()).str());
+}
+
+/* Replays the macro definitions of an already parsed include file */
+bool mx_context::include_lib(const bf::path &name)
+{
+	auto lib(cache->find_lib(name));
+
+	if (!lib)
+		return false;
+
+	BOOST_FOREACH(auto const &m, lib->macros) {
+		note_macro_use(m.first);
+
+		auto iter(macros.find(m.first));
+
+		if (iter != macros.end()) {
+			warning(warn) << "macro " << m.first
+				      << " redefined at "
+				      << in.back().location();
+			macro_ver -= macro_hash(iter->first, iter->second);
+			iter->second = m.second;
+		} else
+			macros.insert(m);
+
+		macro_ver += macro_hash(m.first, m.second);
+		note_macro(m.first);
+	}
+
+	BOOST_FOREACH(lib_rec_t &r, lib_recs)
+		r.deps.insert(lib->deps.begin(), lib->deps.end());
+
+	if (sect_rec.active)
+		sect_rec.deps.insert(lib->deps.begin(), lib->deps.end());
 
-	c_macro->second.e_pos = in.back().line_cnt + 1;
-	unindent_lines(c_macro->second.lines);
-	c_macro = macros.end();
+	BOOST_FOREACH(auto const &d, lib->deps)
+		deps.insert(d.first);
+
+	if (in.size() == 1)
+		include_note(name, lib->base_name);
+
+	return true;
 }
 
-void mx_context::include(const string &line)
+void mx_context::store_lib()
 {
-	if (line.empty())
-		return;
+	lib_rec_t &r(lib_recs.back());
 
-	BOOST_FOREACH(bf::path &p, includes) {
-		bf::path f(bf::system_complete(p / line));
+	if (r.valid) {
+		shared_ptr<macro_lib> lib(new macro_lib());
 
-		if (exists(p)) {
-			in.push_back(new in_file(f));
+		lib->base_name = in.back().base_name;
+		lib->deps = r.deps;
 
-			if (in.back().s.is_open()) {
-				parse_line = &mx_context::parse_line_include;
-				add_line = &mx_context::add_line_noop;
-				return;
-			} else
-				in.pop_back();
+		BOOST_FOREACH(const string &m, r.macros) {
+			auto iter(macros.find(m));
+
+			if (iter != macros.end())
+				lib->macros.push_back(*iter);
 		}
+
+		cache->libs[r.name.file_string()] = lib;
 	}
 
-	cerr << "couldn't open include file " << line << " at "
-	     << in.back().location() << " - skipping." << endl;
+	lib_recs.pop_back();
 }
 
-void mx_context::author(const string &line)
+static size_t hash_mix(size_t h, size_t v)
 {
-	if (!line.empty()) {
-		t_iter = doc_iter;
-		t_iter->second.add_line(":Author: " + line);
-	}
+	return h ^ (v + 0x9e3779b9 + (h << 6) + (h >> 2));
 }
 
-void mx_context::version(const string &line)
+size_t mx_context::macro_mem(const string &name, const macro_t &m)
 {
-	if (!line.empty()) {
-		t_iter = doc_iter;
-		t_iter->second.add_line(":Version: " + line);
-	}
+	size_t rv(map_node_size<string, macro_t>() + string_mem(name)
+		  + string_mem(m.f_name));
+
+	BOOST_FOREACH(auto const &l, m.lines)
+		rv += sizeof(l) + 2 * sizeof(void *) + string_mem(l.first);
+
+	return rv;
 }
 
-void mx_context::date(const string &line)
+size_t mx_context::macro_hash(const string &name, const macro_t &m)
 {
-	if (!line.empty()) {
-		t_iter = doc_iter;
-		t_iter->second.add_line(":Date: " + line);
-	}
+	hash<string> str_hash;
+	size_t rv(hash_mix(str_hash(name), str_hash(m.f_name)));
+
+	rv = hash_mix(rv, m.b_pos);
+
+	BOOST_FOREACH(auto const &s, m.lines)
+		rv = hash_mix(rv, str_hash(s.first));
+
+	return rv;
 }
 
-void mx_context::noindent(const string &line)
+void mx_context::note_macro(const string &name)
 {
-	t_iter = doc_iter;
-	t_iter->second.add_line(line);
+	BOOST_FOREACH(lib_rec_t &r, lib_recs)
+		r.macros.insert(name);
+
+	if (sect_rec.active)
+		sect_rec.macros.insert(name);
 }
 
-void mx_context::title(const string &line)
+/* A section is replayed only under the same definitions of the macros it
+ * looked up; the ones it defines itself are replayed along with it.
+ */
+void mx_context::note_macro_use(const string &name)
 {
-	if (!line.empty()) {
-		t_iter = doc_iter;
-		t_iter->second.add_line();
-		t_iter->second.add_line(line);
-		t_iter->second.add_line(string(line.size(),
-					       get_level_head(TITLE_LVL)));
-		if (ref_name.empty())
-			ref_name = line;
-	}
+	if (!sect_rec.active || sect_rec.macros.count(name)
+	    || sect_rec.used.count(name))
+		return;
+
+	auto iter(macros.find(name));
+
+	sect_rec.used[name] = (iter == macros.end())
+			      ? 0 : macro_hash(iter->first, iter->second);
 }
 
-void mx_context::module(const string &line)
+void mx_context::note_warning(const string &msg)
 {
-	if (!line.empty()) {
-		t_iter = doc_iter;
-		t_iter->second.add_line();
-		t_iter->second.add_line(line);
-		t_iter->second.add_line(string(line.size(),
-					       get_level_head(MODULE_LVL)));
-		if (ref_name.empty())
-			ref_name = line;
-	}
+	if (sect_rec.active)
+		sect_rec.warnings.push_back(msg);
+
+	if (warn_sink)
+		warn_sink(msg);
 }
 
-void mx_context::section(const string &line)
+void mx_context::note_flag(const string &name, bool set)
 {
-	if (!line.empty()) {
-		t_iter = doc_iter;
-		t_iter->second.add_line();
-		t_iter->second.add_line(line);
-		t_iter->second.add_line(string(line.size(),
-					       get_level_head(SECT_LVL)));
+	if (sect_rec.active)
+		sect_rec.flags[name] = set;
+}
+
+bool mx_context::flags_match(const mx_section &sect) const
+{
+	BOOST_FOREACH(auto const &f, sect.flags) {
+		if (bool(defines.count(f.first)) != f.second)
+			return false;
 	}
+
+	return true;
 }
 
-void mx_context::subsection(const string &line)
+/* Captures the parser state; fails, unless the parser is at the top level
+ * of the document, outside of any block.
+ */
+bool mx_context::sect_state(sect_state_t &st) const
 {
-	if (!line.empty()) {
-		t_iter = doc_iter;
-		t_iter->second.add_line();
-		t_iter->second.add_line(line);
-		t_iter->second.add_line(string(line.size(),
-					       get_level_head(SUBSECT_LVL)));
+	auto a_line(add_line.target<tag_method_t>());
+	auto p_line(parse_line.target<tag_method_t>());
+
+	if ((in.size() != 1) || !envs.empty() || !prefixes.empty()
+	    || auto_end || !a_line || !p_line
+	    || (*p_line != &mx_context::parse_line_doc)
+	    || !saved_line.first.empty() || !extra_lines.empty()
+	    || (c_macro != macros.end()) || (t_iter != doc_iter))
+		return false;
+
+	st.add_line = *a_line;
+	st.base_name = in.front().base_name;
+	st.min_sec_lvl = min_sec_lvl;
+	st.abs_sec_lvl = abs_sec_lvl;
+	st.rel_sec_lvl = rel_sec_lvl;
+	st.image_cnt = image_cnt;
+	st.modulename_set = modulename_set;
+	st.ref_name_set = !ref_name.empty();
+	st.end_pos = end_pos;
+	st.info_lines = info_lines;
+	st.targets.clear();
+
+	for (auto t = out_files.begin(); t != out_files.end(); ++t) {
+		const target &x(t->second);
+		sect_state_t::target_t s_t;
+
+		if (x.src_ref_pos != string::npos)
+			return false;
+
+		s_t.tag = t->first;
+		s_t.padding = x.padding;
+		s_t.src_name = x.src_name;
+		s_t.line_cnt = (t == doc_iter) ? 0 : x.line_cnt;
+		s_t.src_line = x.src_line;
+		s_t.first_exp = x.line_exp.empty() ? string::npos
+						   : x.line_exp.begin()->first;
+		st.targets.push_back(s_t);
 	}
+
+	return true;
 }
 
-void mx_context::paragraph(const string &line)
+/* Called at section boundaries: stores the section just parsed, splices in
+ * any following sections, unchanged since the last conversion, and starts
+ * recording the next one.
+ */
+void mx_context::checkpoint()
 {
-	t_iter = doc_iter;
-	t_iter->second.add_line();
+	sect_state_t st;
 
-	if (!line.empty()) {
-		t_iter->second.add_line(line);
-		t_iter->second.add_line(string(line.size(),
-					       get_level_head(PAR_LVL)));
-	} else
-		t_iter->second.add_line();
+	finish_section();
+
+	if (!sect_state(st))
+		return;
+
+	while (replay_section(st))
+		sect_state(st);
+
+	sect_rec.active = true;
+	sect_rec.offset = in.front().m.pos();
+	sect_rec.line = in.front().line_cnt;
+	sect_rec.line_dep = false;
+	sect_rec.state = st;
+	sect_rec.starts.clear();
+	sect_rec.macros.clear();
+	sect_rec.used.clear();
+	sect_rec.deps.clear();
+	sect_rec.flags.clear();
+	sect_rec.warnings.clear();
+	sect_rec.errors = errors;
+
+	for (auto t = out_files.begin(); t != out_files.end(); ++t) {
+		sect_rec_t::start_t &s(sect_rec.starts[t->first]);
+
+		s.text = t->second.text_base + t->second.text.size();
+		s.refs = t->second.line_refs.size();
+		s.line_cnt = t->second.line_cnt;
+	}
 }
 
-void mx_context::node(const string &line)
+void mx_context::finish_section()
 {
-	vector<string> nodes;
-	split_csv(nodes, make_pair(line.begin(), line.end()));
-	bool e_line(false);
+	if (!sect_rec.active)
+		return;
 
-	t_iter = doc_iter;
+	sect_rec.active = false;
 
-	BOOST_FOREACH(const string &s, nodes) {
-		if (!s.empty()) {
-			if (!e_line) {
-				t_iter->second.add_line();
-				e_line = true;
-			}
-			t_iter->second.add_line((boost::format(".. _%1%:")
-						 % s).str());
+	size_t offset(in.front().m.pos());
+	shared_ptr<mx_section> sect(new mx_section());
+
+	if ((offset == sect_rec.offset) || !sect_state(sect->exit))
+		return;
+
+	sect->text = in.front().data->substr(sect_rec.offset,
+					     offset - sect_rec.offset);
+	sect->line = sect_rec.line;
+	sect->lines = in.front().line_cnt - sect_rec.line;
+	sect->line_dep = sect_rec.line_dep;
+	sect->entry = sect_rec.state;
+	sect->ref_name = ref_name;
+	sect->used = sect_rec.used;
+	sect->deps = sect_rec.deps;
+	sect->flags = sect_rec.flags;
+	sect->warnings = sect_rec.warnings;
+	sect->errors = errors - sect_rec.errors;
+
+	for (auto t = out_files.begin(); t != out_files.end(); ++t) {
+		const target &x(t->second);
+		sect_rec_t::start_t s = {0, 0, 0};
+		auto s_iter(sect_rec.starts.find(t->first));
+
+		if (s_iter != sect_rec.starts.end()) {
+			s = s_iter->second;
+
+			if (x.line_cnt == s.line_cnt)
+				continue;
+		}
+
+		sect->outputs.push_back(mx_section::output_t());
+
+		mx_section::output_t &o(sect->outputs.back());
+		const target::lines_t &l(x.lines);
+		const target::line_refs_t &r(x.line_refs);
+
+		o.tag = t->first;
+		o.text = x.text.substr(s.text - x.text_base,
+				       x.text_base + x.text.size() - s.text);
+		o.line_cnt = x.line_cnt - s.line_cnt;
+		o.atoms = x.atoms;
+
+		for (size_t c_pos(s.line_cnt - x.line_base); c_pos < l.size();
+		     ++c_pos)
+			o.lines.push_back(l.begin[c_pos] - s.text,
+					  target::line_kind_t(l.kind[c_pos]),
+					  l.padding[c_pos],
+					  (l.kind[c_pos] == target::REF_LINE)
+					  ? l.aux[c_pos] - s.refs
+					  : l.aux[c_pos]);
+
+		for (size_t c_pos(s.refs); c_pos < r.size(); ++c_pos) {
+			o.refs.lines.push_back(r.lines[c_pos]);
+			o.refs.tag.push_back(r.tag[c_pos]);
+			o.refs.f_name.push_back(r.f_name[c_pos]);
+			o.refs.kind.push_back(r.kind[c_pos]);
+			o.refs.header.push_back(r.header[c_pos]);
 		}
+
+		for (auto e = x.line_exp.upper_bound(s.line_cnt);
+		     e != x.line_exp.end(); ++e)
+			o.line_exp.insert(make_pair(e->first - s.line_cnt,
+						    e->second));
 	}
 
-	if (e_line)
-		t_iter->second.add_line();
-}
+	BOOST_FOREACH(const string &name, sect_rec.macros) {
+		auto iter(macros.find(name));
 
-void mx_context::menu(const string &line)
-{
-	envs.push(make_pair("menu", &mx_context::end_menu));
+		if (iter != macros.end())
+			sect->macros.push_back(*iter);
+	}
 
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	parse_line = &mx_context::parse_line_literal;
-	add_line = &mx_context::add_line_menu;
+	new_sects->insert(make_pair(hash<string>()(sect->text), sect));
 }
 
-void mx_context::end_menu(const string &line)
+/* Splices in the output of the next section, if it was parsed last time
+ * from the same text and parser state.
+ */
+bool mx_context::replay_section(const sect_state_t &st)
 {
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	t_iter->second.add_line();
-	add_line = &mx_context::add_line_markup;
-}
+	const string &data(*in.front().data);
+	size_t b_pos(in.front().m.pos()), e_pos(b_pos);
 
-void mx_context::example(const string &line)
-{
-	envs.push(make_pair("example", &mx_context::end_example));
+	if (!old_sects || (b_pos >= data.size()))
+		return false;
 
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	t_iter->second.add_line(".. code-block:: guess");
-	t_iter->second.add_line();
-	parse_line = &mx_context::parse_line_literal;
-	add_line = &mx_context::add_line_asis;
-}
+	while (e_pos < data.size()) {
+		size_t n_pos(data.find('\n', e_pos));
+		size_t l_end(n_pos == string::npos ? data.size() : n_pos);
+		bool last(is_checkpoint(&data[e_pos], &data[0] + l_end));
 
-void mx_context::end_example(const string &line)
-{
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	t_iter->second.add_line();
-	add_line = &mx_context::add_line_markup;
-}
+		e_pos = (n_pos == string::npos) ? data.size() : n_pos + 1;
 
-void mx_context::verbatim(const string &line)
-{
-	envs.push(make_pair("verbatim", &mx_context::end_verbatim));
+		if (last)
+			break;
+	}
 
-	t_iter = doc_iter;
-	t_iter->second.add_line("::");
-	t_iter->second.add_line();
-	t_iter->second.set_indent(prefixes.empty() ? 3
-						   : prefixes.top().second + 3);
-	parse_line = &mx_context::parse_line_literal;
-	add_line = &mx_context::add_line_asis;
+	shared_ptr<const mx_section> sect;
+	auto range(old_sects->equal_range(
+		hash<string>()(data.substr(b_pos, e_pos - b_pos))
+	));
+
+	for (; range.first != range.second; ++range.first) {
+		auto const &c(range.first->second);
+
+		if ((c->text.size() != (e_pos - b_pos))
+		    || data.compare(b_pos, e_pos - b_pos, c->text)
+		    || !(c->entry == st) || !flags_match(*c)
+		    || (c->line_dep && (c->line != in.front().line_cnt)))
+			continue;
+
+		bool valid(true);
+
+		BOOST_FOREACH(auto const &d, c->deps) {
+			if (cache->overlays.count(d.first)
+			    || (cache->stamp(d.first) != d.second)) {
+				valid = false;
+				break;
+			}
+		}
+
+		for (auto u = c->used.begin(); valid && (u != c->used.end());
+		     ++u) {
+			auto iter(macros.find(u->first));
+
+			valid = u->second == ((iter == macros.end())
+					      ? 0 : macro_hash(iter->first,
+							       iter->second));
+		}
+
+		if (valid) {
+			sect = c;
+			break;
+		}
+	}
+
+	if (!sect)
+		return false;
+
+	BOOST_FOREACH(auto const &o, sect->outputs) {
+		auto t_iter(out_files.find(o.tag));
+
+		if (t_iter == out_files.end()) {
+			t_iter = out_files.insert(make_pair(o.tag,
+							    target(o.tag)))
+					  .first;
+			open_target(t_iter);
+		}
+
+		target &x(t_iter->second);
+		size_t b_off(x.text_base + x.text.size());
+		unsigned int l_off(x.line_cnt), r_off(x.line_refs.size());
+
+		x.text += o.text;
+		x.line_cnt += o.line_cnt;
+
+		for (size_t c_pos(0); c_pos < o.lines.size(); ++c_pos) {
+			auto kind(target::line_kind_t(o.lines.kind[c_pos]));
+			auto pad(x.atom(o.atoms[o.lines.padding[c_pos]]));
+
+			x.lines.push_back(o.lines.begin[c_pos] + b_off, kind,
+					  pad,
+					  (kind == target::REF_LINE)
+					  ? o.lines.aux[c_pos] + r_off
+					  : o.lines.aux[c_pos]);
+
+			if (kind != target::TEXT_LINE)
+				x.first_pending = min(x.first_pending,
+						      size_t(l_off + c_pos));
+		}
+
+		for (size_t c_pos(0); c_pos < o.refs.size(); ++c_pos) {
+			x.line_refs.lines.push_back(o.refs.lines[c_pos]);
+			x.line_refs.tag.push_back(
+				x.atom(o.atoms[o.refs.tag[c_pos]])
+			);
+			x.line_refs.f_name.push_back(
+				x.atom(o.atoms[o.refs.f_name[c_pos]])
+			);
+			x.line_refs.kind.push_back(o.refs.kind[c_pos]);
+			x.line_refs.header.push_back(o.refs.header[c_pos]);
+		}
+
+		BOOST_FOREACH(auto const &e, o.line_exp)
+			x.line_exp.insert(make_pair(e.first + l_off,
+						    e.second));
+	}
+
+	BOOST_FOREACH(auto const &s_t, sect->exit.targets) {
+		target &x(out_files[s_t.tag]);
+
+		x.padding = s_t.padding;
+		x.pad_id = x.atom(x.padding);
+		x.src_name = s_t.src_name;
+		x.src_line = s_t.src_line;
+	}
+
+	BOOST_FOREACH(auto const &m, sect->macros) {
+		auto iter(macros.find(m.first));
+
+		if (iter != macros.end())
+			macro_ver -= macro_hash(iter->first, iter->second);
+
+		macros[m.first] = m.second;
+		macro_ver += macro_hash(m.first, m.second);
+	}
+
+	BOOST_FOREACH(const string &w, sect->warnings) {
+		if (warn_sink)
+			warn_sink(w);
+	}
+
+	errors += sect->errors;
+
+	BOOST_FOREACH(auto const &d, sect->deps)
+		deps.insert(d.first);
+
+	add_line = sect->exit.add_line;
+	in.front().base_name = sect->exit.base_name;
+	min_sec_lvl = sect->exit.min_sec_lvl;
+	abs_sec_lvl = sect->exit.abs_sec_lvl;
+	rel_sec_lvl = sect->exit.rel_sec_lvl;
+	image_cnt = sect->exit.image_cnt;
+	modulename_set = sect->exit.modulename_set;
+	end_pos = sect->exit.end_pos;
+	info_lines = sect->exit.info_lines;
+
+	if (ref_name.empty())
+		ref_name = sect->ref_name;
+
+	in.front().line_cnt += sect->lines;
+	in.front().m.skip(sect->text.size());
+	new_sects->insert(make_pair(hash<string>()(sect->text), sect));
+	return true;
 }
 
-void mx_context::end_verbatim(const string &line)
+void mx_context::open_target(decltype(out_files.begin()) t)
 {
-	t_iter = doc_iter;
-	t_iter->second.set_indent(prefixes.empty() ? 0 : prefixes.top().second);
-	t_iter->second.add_line();
-	t_iter->second.add_line();
-	add_line = &mx_context::add_line_markup;
+	auto iter(target_fds.find(t->first));
+
+	t->second.discard = check;
+
+	if (iter != target_fds.end())
+		t->second.sink.reset(new fd_ostream(iter->second));
 }
 
-void mx_context::itemize(const string &line)
+void mx_context::write_out()
 {
-	envs.push(make_pair("itemize", &mx_context::end_itemize));
-	unsigned int indent(prefixes.empty() ? 0 : prefixes.top().second
-						 + 3);
+	bf::path f_path(out_prefix / in.front().base_name);
 
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	prefixes.push(make_pair("* ", indent));
+	if (output) {
+		for (auto t = out_files.begin(); t != out_files.end(); ++t) {
+			callback_ostream out(bind(output, t->first,
+						  placeholders::_1,
+						  placeholders::_2));
+			double t_write(trace ? mono_time() : 0);
+
+			t->second.out_bytes += t->second.render(
+				out, 0, t->second.lines.size(), out_files
+			);
+
+			if (trace)
+				trace->span("write", t->first, t_write,
+					    mono_time());
+		}
+		return;
+	}
+
+	for (auto t = out_files.begin(); t != out_files.end(); ++t) {
+		auto x_path(f_path); /*There can be some funny extensions */
+		double t_write(trace ? mono_time() : 0);
+		x_path.replace_extension(t->first);
+
+		if (!t->second.sink) {
+			string t_name(make_temp_file(x_path));
+
+			if (t_name.empty()) {
+				warning(warn) << "couldn't create temporary "
+						 "file for " << x_path
+					      << " - skipping.";
+				continue;
+			}
+
+			t->second.sink_file.reset(new temp_file(t_name));
+			t->second.sink.reset(new ofstream(t_name.c_str(),
+							  ios::binary));
+		}
+
+		const string s_name(t->second.sink_file
+				    ? t->second.sink_file->name.file_string()
+				    : string());
+
+		t->second.out_bytes += t->second.render(
+			*t->second.sink, 0, t->second.lines.size(), out_files
+		);
+		t->second.sink->flush();
+
+		if (s_name.empty()) {
+			if (t->second.sink->fail())
+				warning(warn) << "couldn't write " << t->first
+					      << " output";
+		} else if (t->second.sink->fail())
+			warning(warn) << "couldn't write " << x_path
+				      << " - skipping.";
+		else if (!same_content(x_path, s_name)
+			 && !std::rename(s_name.c_str(),
+					 x_path.file_string().c_str()))
+			t->second.sink_file->release();
+
+		/* The stream is closed before its file is removed */
+		t->second.sink.reset();
+		t->second.sink_file.reset();
+
+		if (trace)
+			trace->span("write", x_path.file_string(), t_write,
+				    mono_time());
+	}
 }
 
-void mx_context::enumerate(const string &line)
+/* Compares the targets with the output of the other engine in "ref_dir",
+ * reporting the first differing line of each and the targets only one of
+ * them has; returns the number of differing targets.
+ */
+size_t mx_context::diff_out(const bf::path &ref_dir)
 {
-	envs.push(make_pair("enumerate", &mx_context::end_itemize));
-	unsigned int indent(prefixes.empty() ? 0 : prefixes.top().second
-						    + 3);
+	bf::path f_path(ref_dir / in.front().base_name);
+	size_t rv(0);
 
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	prefixes.push(make_pair("#. ", indent));
-}
+	for (auto t = out_files.begin(); t != out_files.end(); ++t) {
+		auto x_path(f_path);
+		x_path.replace_extension(t->first);
 
-void mx_context::end_itemize(const string &line)
-{
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	prefixes.pop();
+		ostringstream out;
+		ifstream ref_in(x_path.file_string().c_str(), ios::binary);
 
-	if (prefixes.empty())
-		t_iter->second.set_indent(0);
-	else
-		t_iter->second.set_indent(prefixes.top().second);
-}
+		if (!ref_in) {
+			warning(warn) << boost::format("target %1% is missing "
+						       "from the fast engine "
+						       "output")
+					 % t->first;
+			++rv;
+			continue;
+		}
 
-/* Handled as a definition list */
-void mx_context::table(const string &line)
-{
-	envs.push(make_pair("table", &mx_context::end_table));
-	unsigned int indent(prefixes.empty() ? 0 : prefixes.top().second
-						    + 3);
+		string ref((istreambuf_iterator<char>(ref_in)),
+			   istreambuf_iterator<char>());
+		const target &x(t->second);
+
+		x.render(out, 0, x.lines.size(), out_files);
+
+		const string text(out.str());
+		auto d_pos(mismatch(text.begin(),
+				    text.begin() + min(text.size(), ref.size()),
+				    ref.begin()));
+
+		unlink(x_path.file_string().c_str());
+
+		if ((text.size() == ref.size()) && (d_pos.first == text.end()))
+			continue;
+
+		/* Both texts are the same up to "d_off", so the line start
+		 * "b" is valid in either of them.
+		 */
+		size_t d_off(d_pos.first - text.begin());
+		size_t o_line(count(text.begin(), d_pos.first, '\n'));
+		size_t b(d_off ? text.rfind('\n', d_off - 1) : string::npos);
+		size_t pos(x.rendered_line(o_line));
+		string where("end of source");
+
+		b = (b == string::npos) ? 0 : b + 1;
+
+		if (pos < x.src_pos.size())
+			where = (boost::format("%1%:%2%")
+				 % x.atoms[x.src_pos[pos].first]
+				 % x.src_pos[pos].second).str();
+
+		warning(warn) << boost::format("target %1% differs at line "
+					       "%2% (%3%)\n  legacy: %4%\n"
+					       "  fast:   %5%")
+				 % t->first % (o_line + 1) % where
+				 % text.substr(b, text.find('\n', b) - b)
+				 % ref.substr(b, ref.find('\n', b) - b);
+		++rv;
+	}
 
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	prefixes.push(make_pair(string(), indent));
+	/* Whatever the comparison left is a target of the fast engine only */
+	for (bf::directory_iterator d(ref_dir), e; d != e; ++d) {
+		string name(d->path().filename());
+		size_t pos(name.rfind('.'));
+
+		warning(warn) << boost::format("target %1% is missing from "
+					       "the legacy engine output")
+				 % (pos != string::npos ? name.substr(pos + 1)
+							: name);
+		unlink(d->path().file_string().c_str());
+		++rv;
+	}
+
+	return rv;
 }
 
-void mx_context::end_table(const string &line)
-{
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	prefixes.pop();
+struct toc_entry_t {
+	bf::path src_path;
+	string name;
+	string desc;
+	/* Last conversion succeeded */
+	bool valid;
+	/* Files the last conversion was built from */
+	set<string> deps;
+	string error;
 
-	if (prefixes.empty())
-		t_iter->second.set_indent(0);
-	else
-		t_iter->second.set_indent(prefixes.top().second);
-}
+	toc_entry_t(const string &f_name) : src_path(f_name), valid(false) {}
+	bf::path parent_path() const { return src_path.parent_path(); }
+	operator const char *() { return src_path.file_string().c_str(); }
+};
 
-void mx_context::multitable(const string &line)
+void write_index(const bf::path &index_path, const vector<toc_entry_t> &toc,
+		 const warn_fn &warn)
 {
-	envs.push(make_pair("multitable", &mx_context::end_multitable));
-	unsigned int indent(prefixes.empty() ? 0 : prefixes.top().second
-						 + 3);
+	ostringstream ofile;
+	bf::path full_index_path(bf::system_complete(index_path).parent_path());
 
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	prefixes.push(make_pair(string(), indent));
-}
+	ofile << ".. toctree::\n   :maxdepth: 2\n\n";
 
-void mx_context::end_multitable(const string &line)
-{
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	prefixes.pop();
+	BOOST_FOREACH(const toc_entry_t &t, toc) {
+		if (!t.valid)
+			continue;
 
-	if (prefixes.empty())
-		t_iter->second.set_indent(0);
-	else
-		t_iter->second.set_indent(prefixes.top().second);
-}
+		bf::path rel_path(find_relative(bf::system_complete(t.src_path)
+							.parent_path(),
+						full_index_path));
+		rel_path /= t.name;
 
-void mx_context::end(const string &line)
-{
-	if (!line.empty()) {
-		if (envs.empty()
-		    || (line != envs.top().first))
-			throw runtime_error((boost::format("unbalanced end tag "
-							   "%1% at %2%")
-					     % line % in.back().location())
-					    .str());
 
-		envs.top().second(this, line);
-		envs.pop();
+		if (!t.desc.empty())
+			ofile << boost::format("   %1% <%2%>\n")
+				 % t.desc % rel_path.file_string();
+		else
+			ofile << "   " << rel_path << endl;
 	}
+
+	write_file(index_path, __gnu_cxx::crope(ofile.str().c_str()), warn);
 }
 
-void mx_context::item(const string &line)
+static bool convert(toc_entry_t &entry, const mx_config &cfg)
 {
-	decltype(mx_item_tags.begin()) iter;
+	string f(entry.src_path.file_string());
+	mx_config x_cfg(cfg);
 
-	if (envs.empty()
-	    || (mx_item_tags.end()
-		== (iter = mx_item_tags.find(envs.top().first)))) {
-		cerr << "ignoring loose @item at " << in.back().location()
-		     << endl;
-		return;
+	/* The configurations share the caches: sections testing none of the
+	 * flags they differ in are parsed by the first one only.
+	 */
+	if (!cfg.configs.empty()) {
+		bf::path out_base(cfg.out_dir.empty()
+				  ? bf::system_complete(f).parent_path()
+				  : bf::path(cfg.out_dir));
+		bool rv(true);
+		string error;
+		set<string> deps;
+
+		BOOST_FOREACH(auto const &c, cfg.configs) {
+			x_cfg.configs.clear();
+			x_cfg.defines = cfg.defines;
+			x_cfg.defines.insert(c.second.begin(), c.second.end());
+			x_cfg.out_dir = out_base / c.first;
+
+			/* The output directory may be a path of several
+			 * levels; without it, the configuration fails.
+			 */
+			bool out_ok(true);
+
+			if (!cfg.check && !cfg.output) {
+				try {
+					bf::create_directories(x_cfg.out_dir);
+				} catch (const exception &err) {
+					warning(cfg.warn) << "runtime error: "
+							  << err.what();
+					entry.valid = false;
+					entry.error = err.what();
+					out_ok = false;
+				}
+			}
+
+			if ((!out_ok || !convert(entry, x_cfg)) && rv) {
+				rv = false;
+				error = entry.error;
+			}
+
+			deps.insert(entry.deps.begin(), entry.deps.end());
+
+			if (cfg.stats)
+				cfg.stats->back().source = c.first + ":"
+							   + f;
+
+			if ((f == "-") && (cfg.configs.size() > 1)) {
+				warning(cfg.warn) << "standard input can't be "
+						     "converted more than "
+						     "once, only "
+						     "configuration "
+						  << c.first << " is used";
+				break;
+			}
+		}
+
+		entry.valid = rv;
+		entry.error = error;
+		entry.deps.swap(deps);
+		return rv;
 	}
 
-	iter->second(this, line);
-}
+	/* Filter mode */
+	if (f == "-")
+		x_cfg.target_fds.insert(make_pair(cfg.doc_tag, STDOUT_FILENO));
+	else
+		entry.deps.insert(bf::system_complete(f).file_string());
+
+	/* No output to compare */
+	if (cfg.check && (cfg.engine == mx_config::DIFF_ENGINE))
+		x_cfg.engine = mx_config::FAST_ENGINE;
+
+	if ((x_cfg.engine == mx_config::DIFF_ENGINE) && (f == "-")) {
+		warning(cfg.warn) << "standard input can't be converted "
+				     "twice, engines are not compared";
+		x_cfg.engine = mx_config::FAST_ENGINE;
+	} else if (x_cfg.engine == mx_config::DIFF_ENGINE) {
+		/* The fast engine writes into a scratch directory first */
+		x_cfg.diff_dir = ((cfg.out_dir.empty()
+				   ? bf::system_complete(f).parent_path()
+				   : bf::path(cfg.out_dir))
+				  / ".mx2sphinx.XXXXXX").file_string();
+
+		if (!mkdtemp(&x_cfg.diff_dir[0])) {
+			warning(cfg.warn) << "couldn't create temporary "
+					     "directory for " << f
+					  << " - engines are not compared";
+			x_cfg.diff_dir.clear();
+		} else {
+			mx_config f_cfg(cfg);
+			toc_entry_t f_entry(f);
+
+			f_cfg.engine = mx_config::FAST_ENGINE;
+			f_cfg.out_dir = x_cfg.diff_dir;
+			f_cfg.output = nullptr;
+			f_cfg.target_fds.clear();
+			f_cfg.stats = 0;
+			f_cfg.profile = 0;
+			f_cfg.trace = 0;
+			f_cfg.mem = 0;
+			convert(f_entry, f_cfg);
+		}
 
-void mx_context::tab(const string &line)
-{
-	decltype(mx_item_tags.begin()) iter;
+		x_cfg.engine = mx_config::LEGACY_ENGINE;
+	}
 
-	if (envs.empty()
-	    || (mx_item_tags.end()
-		== (iter = mx_item_tags.find(envs.top().first)))) {
-		cerr << "ignoring loose @tab at " << in.back().location()
-		     << endl;
-		return;
+	/* No caches, streaming or spill files */
+	if (x_cfg.engine == mx_config::LEGACY_ENGINE) {
+		x_cfg.cache = 0;
+		x_cfg.stream_size = 0;
+		x_cfg.spill_size = 0;
 	}
 
-	add_line_markup(line);
-	t_iter->second.set_indent(prefixes.top().second + 6);
-}
+	if (x_cfg.check) {
+		x_cfg.stream_size = 0;
+		x_cfg.spill_size = 0;
+	}
 
+	if (x_cfg.output) {
+		x_cfg.target_fds.clear();
+		x_cfg.stream_size = 0;
+	} else if (!x_cfg.target_fds.empty() && !x_cfg.stream_size
+		   && (x_cfg.engine != mx_config::LEGACY_ENGINE))
+		x_cfg.stream_size = 4096;
 
-void mx_context::item_itemize(const string &line)
-{
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	t_iter->second.set_indent(prefixes.top().second);
-	add_line_markup(prefixes.top().first + line);
-	t_iter->second.set_indent(prefixes.top().second
-				  + prefixes.top().first.size());
-}
+	if (cfg.stats)
+		cfg.stats->push_back(conv_stats(f));
 
-void mx_context::item_table(const string &line)
-{
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	t_iter->second.set_indent(prefixes.top().second);
-	add_line_markup(prefixes.top().first + line);
-	t_iter->second.set_indent(prefixes.top().second + 3);
-}
+	if (cfg.mem)
+		cfg.mem->push_back(mem_stats(f));
 
-void mx_context::subblock(const string &line)
-{
-	envs.push(make_pair("{", &mx_context::end_subblock));
-}
+	double t_start(mono_time());
 
-void mx_context::end_subblock(const string &line)
-{
-	if (envs.empty() || ("{" != envs.top().first))
-		cerr << (boost::format("unbalanced subblock end at "
-				       "%1% - ignoring.")
-			 % in.back().location()) << endl;
-	else {
-		t_iter->second.textref_formatter(
-				bind(&mx_context::add_line_asis,
-				     this, placeholders::_1),
-				in.back().name.filename(),
-				in.back().line_cnt + 1
-		);
-		envs.pop();
+	try {
+		mx_context mx(f, x_cfg);
+		double t_emit(mono_time());
+
+		if (mx.errors && x_cfg.check)
+			throw runtime_error((boost::format("%1%: %2% "
+							   "problem(s) found")
+					     % f % mx.errors).str());
+		else if (!x_cfg.check)
+			mx.write_out();
+
+		if (!x_cfg.diff_dir.empty() && mx.diff_out(x_cfg.diff_dir))
+			throw runtime_error("legacy and fast engine outputs "
+					    "differ");
+
+		if (mx.stats) {
+			mx.stats->t_emit = mono_time() - t_emit;
+			mx.stats->t_total = mono_time() - t_start;
+
+			for (auto t = mx.out_files.begin();
+			     t != mx.out_files.end(); ++t)
+				mx.stats->bytes_out += t->second.out_bytes;
+		}
+
+		entry.name = mx.in.front().base_name;
+		entry.desc = mx.ref_name;
+		/* Files no longer included are not watched anymore; a failed
+		 * conversion keeps the previous ones, as its fix may be in them
+		 */
+		entry.deps = mx.deps;
+		entry.valid = true;
+		entry.error.clear();
+	} catch (const exception &err) {
+		warning(cfg.warn) << "runtime error: " << err.what();
+		entry.valid = false;
+		entry.error = err.what();
 	}
-}
 
-void mx_context::subblock1(const string &line)
-{
-	envs.push(make_pair("(", &mx_context::end_subblock));
-	add_line_prev = add_line;
-	add_line = &mx_context::add_line_noop;
-}
+	if (!x_cfg.diff_dir.empty()) {
+		for (bf::directory_iterator d(x_cfg.diff_dir), e; d != e; ++d)
+			unlink(d->path().file_string().c_str());
 
-void mx_context::end_subblock1(const string &line)
-{
-	if (envs.empty() || ("(" != envs.top().first))
-		throw runtime_error((boost::format("unbalanced subblock type 1 "
-						  "end at %1%.")
-				     % in.back().location()).str());
-	else {
-		envs.pop();
-		add_line = add_line_prev;
+		rmdir(x_cfg.diff_dir.c_str());
 	}
-}
 
-void mx_context::qtex(const string &line)
-{
-	t_iter = doc_iter;
-/*
-	t_iter->second.add_line("raw:: latex");
-	t_iter->second.add_line();
-	auto_end = &mx_context::end_qtex;
-*/
-}
+	if (cfg.trace)
+		cfg.trace->span("source", f, t_start, mono_time());
 
-void mx_context::end_qtex(const string &tag)
-{
-/*
-	t_iter = doc_iter;
-	t_iter->second.add_line();
-	t_iter->second.add_line();
-	auto_end.reset();
-*/
+	return entry.valid;
 }
 
-void mx_context::tex(const string &line)
+static void stats_line(ostream &out, const conv_stats &st, bool json)
 {
-	/* Just ignore qtex tags as mostly misplaced */
-
-	envs.push(make_pair("tex", &mx_context::end_tex));
+	double rate(st.t_total > 0 ? st.lines / st.t_total : 0);
+
+	if (!json) {
+		out << boost::format("%-24s %9u %8.3f %8.3f %8.3f %8.3f %8.3f "
+				     "%10.0f %10u %10u %8u %7u %7u %10u\n")
+		       % st.source % st.lines % st.t_parse % st.t_expand
+		       % st.t_late % st.t_emit % st.t_total % rate
+		       % st.bytes_in % st.bytes_out % st.expansions
+		       % st.line_marks % st.line_refs % st.peak_size;
+		return;
+	}
 
-	t_iter = doc_iter;
+	out << boost::format("{\"source\": %s, \"lines\": %u, "
+			     "\"parse_s\": %.6f, \"expand_s\": %.6f, "
+			     "\"late_expand_s\": %.6f, \"emit_s\": %.6f, "
+			     "\"total_s\": %.6f, \"lines_per_s\": %.0f, "
+			     "\"bytes_in\": %u, \"bytes_out\": %u, "
+			     "\"expansions\": %u, \"line_marks\": %u, "
+			     "\"line_refs\": %u, \"peak_target_bytes\": %u}")
+	       % json_string(st.source) % st.lines % st.t_parse % st.t_expand
+	       % st.t_late % st.t_emit % st.t_total % rate % st.bytes_in
+	       % st.bytes_out % st.expansions % st.line_marks % st.line_refs
+	       % st.peak_size;
 }
 
-void mx_context::iftex(const string &line)
+/* Per source and total statistics, as a table or a JSON document */
+static string stats_report(const vector<conv_stats> &stats, bool json)
 {
-	/* Just ignore qtex tags as mostly misplaced */
+	ostringstream out;
+	conv_stats total("total");
 
-	envs.push(make_pair("iftex", &mx_context::end_tex));
+	if (json)
+		out << "{\"sources\": [";
+	else
+		out << boost::format("%-24s %9s %8s %8s %8s %8s %8s %10s %10s "
+				     "%10s %8s %7s %7s %10s\n")
+		       % "source" % "lines" % "parse" % "expand" % "late"
+		       % "emit" % "total" % "lines/s" % "bytes in"
+		       % "bytes out" % "expands" % "marks" % "refs"
+		       % "peak size";
+
+	for (size_t pos(0); pos < stats.size(); ++pos) {
+		if (json && pos)
+			out << ", ";
+
+		stats_line(out, stats[pos], json);
+		total.add(stats[pos]);
+	}
 
-	t_iter = doc_iter;
-}
+	if (json) {
+		out << "], \"total\": ";
+		stats_line(out, total, json);
+		out << "}\n";
+	} else
+		stats_line(out, total, json);
 
-void mx_context::end_tex(const string &line)
-{
-	t_iter = doc_iter;
+	return out.str();
 }
 
-void mx_context::ifset(const string &line)
+/* Macro profile sorted by self time, as a table or a JSON document */
+static string profile_report(const map<string, macro_prof> &profile,
+			     bool json)
 {
-	envs.push(make_pair("ifset", &mx_context::end_if));
-	t_iter = doc_iter;
+	ostringstream out;
+	vector<pair<double, string>> order;
 
-	auto iter(defines.find(line));
-	if (iter != defines.end()) {
-		parse_line = &mx_context::parse_line_doc;
-		add_line = &mx_context::add_line_markup;
-	} else {
-		parse_line = &mx_context::parse_line_literal;
-		add_line = &mx_context::add_line_noop;
+	for (auto m = profile.begin(); m != profile.end(); ++m)
+		order.push_back(make_pair(-m->second.t_self, m->first));
+
+	sort(order.begin(), order.end());
+
+	if (json)
+		out << "{\"macros\": [";
+	else
+		out << boost::format("%-32s %8s %10s %10s %10s %6s %8s\n")
+		       % "macro" % "calls" % "total" % "self" % "bytes"
+		       % "depth" % "forward";
+
+	for (size_t pos(0); pos < order.size(); ++pos) {
+		const macro_prof &m(profile.find(order[pos].second)->second);
+
+		if (!json) {
+			out << boost::format("%-32s %8u %10.6f %10.6f %10u "
+					     "%6u %8u\n")
+			       % order[pos].second % m.calls % m.t_total
+			       % m.t_self % m.bytes % m.max_depth
+			       % m.forward_refs;
+			continue;
+		}
+
+		out << boost::format("%s{\"name\": %s, \"calls\": %u, "
+				     "\"total_s\": %.6f, \"self_s\": %.6f, "
+				     "\"bytes\": %u, \"max_depth\": %u, "
+				     "\"forward_refs\": %u}")
+		       % (pos ? ", " : "") % json_string(order[pos].second)
+		       % m.calls % m.t_total % m.t_self % m.bytes
+		       % m.max_depth % m.forward_refs;
 	}
+
+	if (json)
+		out << "]}\n";
+
+	return out.str();
 }
 
-void mx_context::ifclear(const string &line)
+/* Final and peak sizes of the accounted parts of every document */
+static string mem_report(const vector<mem_stats> &mem)
 {
-	envs.push(make_pair("ifclear", &mx_context::end_if));
-	t_iter = doc_iter;
+	ostringstream out;
 
-	auto iter(defines.find(line));
-	if (iter == defines.end()) {
-		parse_line = &mx_context::parse_line_doc;
-		add_line = &mx_context::add_line_markup;
-	} else {
-		parse_line = &mx_context::parse_line_literal;
-		add_line = &mx_context::add_line_noop;
+	BOOST_FOREACH(const mem_stats &m, mem) {
+		out << boost::format("%-32s %12s %12s  %s\n")
+		       % m.source % "final" % "peak" % "peak at";
+
+		for (auto i = m.items.begin(); i != m.items.end(); ++i)
+			out << boost::format("  %-30s %12u %12u  %s\n")
+			       % i->first % i->second.size % i->second.peak
+			       % i->second.peak_at;
 	}
-}
 
-void mx_context::end_if(const string &line)
-{
-	t_iter = doc_iter;
-	add_line = &mx_context::add_line_markup;
+	return out.str();
 }
 
-void mx_context::generic_tag(const string &tag, const string &line)
+/* Converts the sources again, whenever any of the files they were built
+ * from changes. Directories are watched, rather than files, to catch
+ * editors replacing files on save.
+ */
+static void watch(vector<toc_entry_t> &toc, const mx_config &cfg,
+		  const string &index)
 {
-	// cerr << "gen tag: " << tag << " line: " << line << endl;
+	int fd(inotify_init());
+	map<int, bf::path> dirs;
+	set<string> watched;
+	vector<char> buf(1 << 16);
+
+	if (fd < 0)
+		throw runtime_error("couldn't initialize inotify");
+
+	while (true) {
+		BOOST_FOREACH(const toc_entry_t &t, toc) {
+			BOOST_FOREACH(const string &d, t.deps) {
+				bf::path dir(bf::path(d).parent_path());
+
+				if (!watched.insert(dir.file_string()).second)
+					continue;
+
+				int wd(inotify_add_watch(
+					fd, dir.file_string().c_str(),
+					IN_CREATE | IN_CLOSE_WRITE
+					| IN_MOVED_TO | IN_DELETE
+				));
+
+				if (wd < 0)
+					warning(cfg.warn) << "couldn't watch "
+							  << dir;
+				else
+					dirs[wd] = dir;
+			}
+		}
 
-	t_iter = out_files.find(tag);
+		/* Gather all the events, arriving together with the first */
+		set<string> changed;
+		pollfd p_fd = {fd, POLLIN, 0};
+		int timeout(-1);
 
-	if (t_iter == out_files.end()) {
-		t_iter = out_files.insert(make_pair(tag, target(tag)))
-				  .first;
+		while (poll(&p_fd, 1, timeout) > 0) {
+			ssize_t len(read(fd, &buf[0], buf.size()));
 
-		if (!info_lines.empty())
-			t_iter->second.comment_formatter(
-				bind(&mx_context::add_line_asis,
-				     this, placeholders::_1), info_lines
-			);
-	}
+			for (ssize_t pos(0); pos < len;) {
+				auto ev(reinterpret_cast<inotify_event *>(
+					&buf[pos]
+				));
+				auto iter(dirs.find(ev->wd));
 
-	end_pos = t_iter->second.line_cnt;
-	auto_end = &mx_context::end_generic_tag;
-	add_line = &mx_context::add_line_text;
+				if (ev->len && (iter != dirs.end()))
+					changed.insert((iter->second
+							/ ev->name)
+						       .file_string());
 
-	t_iter->second.textref_formatter(
-		bind(&mx_context::add_line_asis,
-		     this, placeholders::_1),
-		in.back().name.filename(),
-		line.empty() ? in.back().line_cnt + 1
-			     : in.back().line_cnt
-	);
+				pos += sizeof(inotify_event) + ev->len;
+			}
+			timeout = 0;
+		}
 
-	if (!line.empty())
-		add_line(this, line);
-}
+		BOOST_FOREACH(const string &c, changed)
+			cfg.cache->invalidate(c);
 
-static string litinc_editor(size_t s, size_t e)
-{
-	return (boost::format("   :lines: %1%-%2%") % s % e).str();
-}
+		bool rebuilt(false);
 
-static string litinc_head_editor(string f_name, size_t s, size_t e)
-{
-	return (boost::format("%1%: %2% - %3%") % f_name % s % e).str();
-}
+		BOOST_FOREACH(toc_entry_t &t, toc) {
+			BOOST_FOREACH(const string &c, changed) {
+				if (t.deps.count(c)) {
+					convert(t, cfg);
+					rebuilt = true;
+					break;
+				}
+			}
+		}
 
-static string litinc_secline_editor(string f_name, char header, size_t s,
-				    size_t e)
-{
-	size_t len((boost::format("%1%: %2% - %3%") % f_name % s % e)
-		   .str().size());
-	return string(len, header);
+		if (rebuilt && !index.empty())
+			write_index(bf::path(index), toc, cfg.warn);
+	}
 }
 
-void mx_context::end_generic_tag(const string &tag)
+static bool read_full(int fd, char *buf, size_t len)
 {
-	using namespace placeholders;
+	while (len) {
+		ssize_t rv(read(fd, buf, len));
 
-	auto x_iter(t_iter);
-	auto c_pos(x_iter->second.line_cnt);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		else if (rv <= 0)
+			return false;
 
-	t_iter = doc_iter;
+		buf += rv;
+		len -= rv;
+	}
 
-	if (c_pos - end_pos) {
-		end_pos++;
+	return true;
+}
 
-		string f_name((boost::format("%1%.%2%")
-			       % in.back().base_name % (*x_iter).first).str());
+/* A client gone away fails the write, instead of raising SIGPIPE */
+static bool write_full(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t rv(send(fd, buf, len, MSG_NOSIGNAL));
 
-		t_iter->second.add_line();
-		t_iter->second.add_line_ref((*x_iter).first,
-					    bind(litinc_head_editor,
-						 f_name, _1, _2),
-					    end_pos, c_pos);
-		t_iter->second.add_line_ref((*x_iter).first,
-					    bind(litinc_secline_editor, f_name,
-						 get_level_head(SUBSECT_LVL),
-						 _1, _2),
-					    end_pos, c_pos);
-		t_iter->second.add_line(".. literalinclude:: " + f_name);
-		t_iter->second.add_line("   :language: guess");
-		t_iter->second.add_line_ref((*x_iter).first, litinc_editor,
-					    end_pos, c_pos);
-		t_iter->second.add_line();
+		if (rv < 0 && errno == EINTR)
+			continue;
+		else if (rv <= 0)
+			return false;
+
+		buf += rv;
+		len -= rv;
 	}
 
-	auto_end.reset();
-	parse_line = &mx_context::parse_line_doc;
-	add_line = &mx_context::add_line_markup;
+	return true;
 }
 
-string mx_context::replace_doc_tags(const bx::smatch &what)
+/* Stops after "max" + 1 characters of a line, leaving it longer than the
+ * limit.
+ */
+static bool read_line(int fd, string &line, size_t max)
 {
-	string sel((*what.nested_results().begin())[1]);
-	string val((*what.nested_results().begin())[2]);
+	char c;
 
-	if (sel.empty())
-		return what[0];
+	line.clear();
 
-	string tail((*what.nested_results().begin())[3]);
-	string num((*what.nested_results().begin())[4]);
-	string x_tail(tail.empty() ? string("\\ ") : tail);
-	vector<string> out;
+	while (read_full(fd, &c, 1)) {
+		if (c == '\n')
+			return true;
 
-	if (!num.empty())
-		x_tail = "\\ " + num + tail;
+		line.push_back(c);
+		if (line.size() > max)
+			return true;
+	}
 
-	switch (sel[0]) {
-	case 'v': // @verb, @sc, @code
-	case 'c':
-	case 'o':
-		return (boost::format("``%1%``%2%")
-			% trim(make_pair(val.begin() + 1, val.end() - 1))
-			% x_tail).str();
-	case '`': { // code
-		int i_num(0);
+	return false;
+}
 
-		if (!num.empty())
-			x_tail = tail.empty() ? string("\\ ") : tail;
+/* Picks a single section out of the converted documentation, either by
+ * its title, or by the node label preceding it. The section extends up to
+ * the next heading of the same or a higher level.
+ */
+static string select_section(const string &doc, const string &sel)
+{
+	const string heads("#*=-^\"");
+	const string label(".. _" + sel + ":");
+	vector<string> lines;
+	string::size_type pos(0), n_pos;
+
+	while ((n_pos = doc.find('\n', pos)) != string::npos) {
+		lines.push_back(doc.substr(pos, n_pos - pos));
+		pos = n_pos + 1;
+	}
 
-		cerr << "index " << num << " entry at "
-		     << in.back().location() << " - ignored." << endl;
+	if (pos < doc.size())
+		lines.push_back(doc.substr(pos));
 
-		return (boost::format("``%1%``%2%")
-			% trim(make_pair(val.begin(), val.end()))
-			% x_tail).str();
-	}
-	case '%': // emph
-		return (boost::format("*%1%*%2%")
-			% trim(make_pair(val.begin(), val.end()))
-			% x_tail).str();
-	case 'e': // @emph
-		return (boost::format("*%1%*%2%")
-			% trim(make_pair(val.begin() + 1, val.end() - 1))
-			% x_tail).str();
-	case '#': // strong
-		return (boost::format("**%1%**%2%")
-			% trim(make_pair(val.begin(), val.end()))
-			% x_tail).str();
-	case 's': // @strong
-		return (boost::format("**%1%**%2%")
-			% trim(make_pair(val.begin() + 1, val.end() - 1))
-			% x_tail).str();
-	case 't': // @cite
-		return (boost::format("[%1%]_%2%")
-			% trim(make_pair(val.begin() + 1, val.end() - 1))
-			% tail).str();
-	case '[': // link
-		parse_href(out, make_pair(val.begin(), val.end()));
-		if (out.empty())
-			return num + tail;
-		// deliberate fall-through
-	case 'u': // @url
-		if (out.empty())
-			split_csv(out, make_pair(val.begin() + 1,
-						 val.end() - 1));
+	/* Level of the heading at line i, or npos */
+	auto head_lvl = [&](size_t i) -> string::size_type {
+		if ((i + 1 >= lines.size()) || lines[i].empty()
+		    || (lines[i + 1].size() != lines[i].size()))
+			return string::npos;
 
-		switch (out.size()) {
-		case 0:
-			return tail;
-		case 1:
-			return (boost::format("`<%1%>`_%2%") % out[0] % x_tail)
-				.str();
-		default:
-			return (boost::format("`%1%<%2%>`_%3%")
-				% out[1] % out[0] % x_tail).str();
-		}
-	case 'i': // @image
-		split_csv(out, make_pair(val.begin() + 1, val.end() - 1));
+		auto lvl(heads.find(lines[i + 1][0]));
 
-		if (out.empty())
-			return tail;
+		if ((lvl == string::npos)
+		    || (lines[i + 1].find_first_not_of(lines[i + 1][0])
+			!= string::npos))
+			return string::npos;
 
-		extra_lines.push_back((boost::format(".. |image_%1%| image:: "
-						     "%2%.*")
-				       % image_cnt % out[0]).str());
-		return ((boost::format("|image_%1%|%2%")
-			 % (image_cnt++) % x_tail).str());
+		return lvl;
 	};
 
-	return what[0];
-}
+	size_t begin(lines.size()), i;
+	string::size_type lvl(string::npos);
 
-string mx_context::replace_text_tags(const bx::smatch &what)
-{
-	string sel(what[1]);
+	for (i = 0; i < lines.size(); ++i) {
+		if (lines[i] == label) {
+			begin = i;
+			for (; i < lines.size(); ++i)
+				if ((lvl = head_lvl(i)) != string::npos)
+					break;
+			break;
+		} else if ((lines[i] == sel)
+			   && ((lvl = head_lvl(i)) != string::npos)) {
+			begin = i;
+			break;
+		}
+	}
 
-	if (sel.empty())
-		return what[0];
+	if (begin == lines.size())
+		throw runtime_error("no section " + sel);
 
-	if (sel[0] == '`') {
-		cerr << (boost::format("text index reference %1% at %2%) - "
-				       "ignored") % what[3]
-						  % in.back().location())
-		     << endl;
-		return what[2];
+	/* A label with no heading after it runs to the end of the document */
+	size_t end((lvl == string::npos) ? lines.size() : i + 2);
+
+	for (; end < lines.size(); ++end) {
+		auto e_lvl(head_lvl(end));
+
+		if ((e_lvl != string::npos) && (e_lvl <= lvl))
+			break;
 	}
 
-	return what[0];
-}
+	/* Labels and blank lines in front of the next heading belong to it */
+	while ((end > i + 2)
+	       && (lines[end - 1].empty()
+		   || !lines[end - 1].compare(0, 4, ".. _")))
+		--end;
 
-static string replace_macro_args(const vector<string> &args,
-				 const bx::smatch &what)
-{
-	auto p(boost::lexical_cast<unsigned int>(what[2]));
+	string rv;
 
-	if (!what[3].length()) {
-		if (p < 1)
-			return what.str(0);
-		else if (p > args.size())
-			return string();
-		else
-			return args[p - 1];
-	} else {
-		if ((p < 1) || (p > args.size()) || args[p - 1].empty())
-			return "@!!";
-		else
-			return "@";
+	for (i = begin; i < end; ++i) {
+		rv += lines[i];
+		rv += '\n';
 	}
-}
 
-static void push_line(mx_context::line_block_t &out, unsigned int indent,
-		      const string &in)
-{
-	out.push_back(make_pair(in, 0));
-	out.push_back(make_pair(pad_string(indent), 0));
+	return rv;
 }
 
-void mx_context::expand_macros(line_block_t &out, const macro_line_t &in,
-			       const target &t, unsigned int indent,
-			       unsigned int pass)
+/* Serves a single request: the source path (for include lookup and
+ * naming), section selector (empty for the whole document) and the length
+ * of the source text, each on its own line, followed by the source text.
+ * Replies with "ok" or "error", the length of the reply text and the text
+ * itself.
+ */
+static bool serve_request(int fd, const mx_config &cfg)
 {
+	/* Limits of the request, so that a client can't make the server
+	 * allocate without bound
+	 */
+	static const size_t max_line = 4096;
+	static const size_t max_len = 64 << 20;
 
-	macro_line_t m_line;
-	string::const_iterator b_iter, e_iter;
-	unsigned int line_pos;
+	string path, sel, len_str, reply;
+	size_t len(0);
 
-	if (!saved_line.first.empty()) {
-		m_line.first = saved_line.first + in.first;
-		saved_line.first.clear();
-		b_iter = m_line.first.begin();
-		e_iter = m_line.first.end();
-		line_pos = m_line.second;
-	} else {
-		b_iter = in.first.begin();
-		e_iter = in.first.end();
-		line_pos = in.second;
+	if (!read_line(fd, path, max_line) || !read_line(fd, sel, max_line)
+	    || !read_line(fd, len_str, max_line))
+		return false;
+
+	if ((path.size() > max_line) || (sel.size() > max_line)
+	    || (len_str.size() > max_line))
+		reply = "request line too long";
+	else {
+		try {
+			len = boost::lexical_cast<size_t>(len_str);
+
+			if (len > max_len)
+				reply = (boost::format("source too long, at "
+						       "most %1% bytes")
+					 % max_len).str();
+		} catch (const boost::bad_lexical_cast &) {
+			reply = "invalid length " + len_str;
+		}
 	}
 
-	bx::smatch what;
-	bx::sregex_iterator no_match;
+	if (!reply.empty()) {
+		len_str = (boost::format("error %1%\n") % reply.size()).str();
+		write_full(fd, len_str.data(), len_str.size());
+		write_full(fd, reply.data(), reply.size());
+		return false;
+	}
 
-	if (out.empty())
-		out.push_back(make_pair(pad_string(indent), 0));
+	shared_ptr<string> data(new string(len, '\0'));
 
-	while (bx::regex_search(b_iter, e_iter, what, macro_ref_expr)) {
-		if (what.str(3) == "\\") {
-			saved_line = make_pair(what.str(1), line_pos);
-			return;
-		}
+	if (len && !read_full(fd, &(*data)[0], len))
+		return false;
 
-		auto m_iter(macros.find(what.str(1)));
-		auto t_indent(find_print_length(what.prefix()));
-		out.back().first += what.prefix();
+	const string key(bf::system_complete(path).file_string());
+	const char *status("ok");
+	mx_config x_cfg(cfg);
 
-		if (m_iter == macros.end()) {
-			if (pass > 1)
-				cerr << "pass " << pass << ": undefined macro "
-				     << what[1] << ", ignoring for now" << endl;
+	x_cfg.stream_size = 0;
+	x_cfg.target_fds.clear();
+	cfg.cache->overlays[key] = data;
 
-			out.back().first += what[0];
-			out.back().second = line_pos;
-		} else {
-			t.textref_formatter(
-				bind(push_line, ref(out), indent,
-				     placeholders::_1),
-				m_iter->second.f_name, m_iter->second.b_pos
-			);
+	try {
+		mx_context mx(key, x_cfg);
+		ostringstream out;
 
-			vector<string> m_vars;
+		mx.doc_iter->second.render(out, 0,
+					   mx.doc_iter->second.lines.size(),
+					   mx.out_files);
+		reply = out.str();
 
-			if (what[2].length())
-				split_csv(
-					m_vars,
-					make_pair(what[2].first + 1,
-						  what[2].second - 1),
-					csv_paren_expr
-				);
-#ifdef DEBUG_MACROS
-			cerr << "t |" << what[0] << "|" << endl;
-			cerr << "  m |" << what[1] << "|" << endl;
-			int x_cnt(0);
-			BOOST_FOREACH(const string &s, m_vars)
-				cerr << "   v " << x_cnt++ << " |" << s << "|"
-				     << endl;
-#endif
-			function< string (const bx::smatch&) > args_f(
-				bind(replace_macro_args, cref(m_vars),
-				     placeholders::_1));
+		if (!sel.empty())
+			reply = select_section(reply, sel);
+	} catch (const exception &err) {
+		status = "error";
+		reply = err.what();
+	}
 
-			BOOST_FOREACH(auto const &s, m_iter->second.lines) {
-				string m_out(bx::regex_replace(s.first,
-							       macro_arg_expr,
-							       args_f));
-#ifdef DEBUG_MACROS
-				cerr << "m_out >>>" << m_out << endl;
-#endif
-				expand_macros(out, make_pair(m_out, s.second),
-					      t, indent + t_indent, pass);
-			}
+	cfg.cache->overlays.erase(key);
 
-			t.textref_formatter(
-				bind(push_line, ref(out), indent,
-				     placeholders::_1),
-				m_iter->second.f_name, line_pos
-			);
-		}
-		b_iter = what.suffix().first;
-	}
-	out.back().first.append(b_iter, e_iter);
+	len_str = (boost::format("%1% %2%\n") % status % reply.size()).str();
 
-	out.back().first.assign(
-		bx::regex_replace(out.back().first, dead_macro_expr, string())
-	);
-	out.push_back(make_pair(pad_string(indent), 0));
+	return write_full(fd, len_str.data(), len_str.size())
+	       && write_full(fd, reply.data(), reply.size());
 }
 
-void mx_context::late_expand::operator()(target::line_mark &m)
+/* Converts editor buffers sent over a local socket, for previews. The
+ * include files, and the macros defined in them, are kept in the cache
+ * between requests.
+ */
+static void serve(const string &sock_path, const mx_config &cfg)
 {
-	m.begin += delta;
-	m.end += delta;
+	sockaddr_un addr;
+	int fd(socket(AF_UNIX, SOCK_STREAM, 0));
 
-	line_block_t lines;
-	context.expand_macros(lines, make_pair(string(m.begin, m.end - 1),
-					       m.src_pos), *(m.t), 0, 2);
+	if (fd < 0)
+		throw runtime_error("couldn't create socket");
 
-	while (!lines.empty() && lines.back().first.empty())
-		lines.pop_back();
+	if (sock_path.size() >= sizeof(addr.sun_path))
+		throw runtime_error("socket path too long: " + sock_path);
 
-	if (!lines.empty()) {
-		__gnu_cxx::crope t_out;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_path.c_str());
 
-		BOOST_FOREACH(auto const &s, lines) {
-			t_out += m.padding.c_str();
-			t_out += s.first.c_str();
-			t_out += "\n";
-		}
+	/* Only a stale socket is replaced, never some other file */
+	struct stat st;
 
-		size_t x_delta(t_out.size() - (m.end - m.begin));
-		m.t->body.replace(m.begin, m.end, t_out);
-		m.end += x_delta;
-		delta += x_delta;
-		m.t->line_exp[m.line_num] = lines.size();
-	} else
-		m.t->line_exp[m.line_num] = 0;
-}
+	if (!lstat(sock_path.c_str(), &st) && S_ISSOCK(st.st_mode))
+		unlink(sock_path.c_str());
 
-void mx_context::ref_edit::operator()(target::line_ref &m)
-{
-	auto r_tgt(context.out_files.find(m.tag));
+	if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))
+	    || listen(fd, 4))
+		throw runtime_error("couldn't listen on " + sock_path);
 
-	if (r_tgt == context.out_files.end())
-		return;
+	/* A client stalling in the middle of a request is dropped, rather
+	 * than holding up the others
+	 */
+	timeval r_timeout = {10, 0};
 
-	auto p(r_tgt->second.line_exp.begin());
-	auto q(r_tgt->second.line_exp.upper_bound(m.lines.first));
-	auto r(r_tgt->second.line_exp.upper_bound(m.lines.second));
+	while (true) {
+		int c_fd(accept(fd, 0, 0));
 
-	int delta(0);
-	for (; p != q; ++p) {
-		if (!p->second) {
-			if (delta)
-				--delta;
-		} else if (p->second > 1)
-			delta += p->second - 1;
+		if (c_fd < 0) {
+			if (errno != EINTR)
+				throw runtime_error("couldn't accept "
+						    "connection");
+			continue;
+		}
+
+		setsockopt(c_fd, SOL_SOCKET, SO_RCVTIMEO, &r_timeout,
+			   sizeof(r_timeout));
+
+		/* A request failing outside of the conversion only drops its
+		 * connection
+		 */
+		try {
+			while (serve_request(c_fd, cfg)) {}
+		} catch (const exception &err) {
+			warning(cfg.warn) << "runtime error: " << err.what();
+		}
+
+		close(c_fd);
 	}
-	size_t start(m.lines.first + delta);
-	int x_delta(delta);
+}
 
-	for (; p != r; ++p) {
-		if (!p->second) {
-			if (delta)
-				--delta;
-		} else if (p->second > 1)
-			delta += p->second - 1;
+/* Library interface, see mx2sphinx.h */
+struct mx_converter {
+	mx_config cfg;
+	file_cache cache;
+	vector<toc_entry_t> toc;
+	/* Outcome of the last conversion */
+	string name, error;
+	vector<conv_stats> stats;
+	map<string, macro_prof> profile;
+	shared_ptr<trace_log> trace;
+	vector<mem_stats> mem;
+	string report;
+	mx_include_fn resolve;
+	void *resolve_arg;
+	mx_output_fn output;
+	void *output_arg;
+	mx_warning_fn warn;
+	void *warn_arg;
+	/* Keep the cache between conversions, even if nothing needs it */
+	bool use_cache;
+
+	mx_converter()
+	: resolve(0), resolve_arg(0), output(0), output_arg(0), warn(0),
+	  warn_arg(0), use_cache(true) {}
+
+	/* Buffers, resolved files, watching and serving only work through
+	 * the cache.
+	 */
+	void select_cache(bool needed) {
+		cfg.cache = (use_cache || needed || resolve) ? &cache : 0;
+	}
+
+	bool resolve_file(const string &path, string &data) {
+		const char *r_data(0);
+		size_t r_len(0);
+
+		if (!resolve(resolve_arg, path.c_str(), &r_data, &r_len))
+			return false;
+
+		data.assign(r_data, r_len);
+		return true;
 	}
-	size_t end(m.lines.second + delta);
 
-	if (delta || x_delta) {
-		string t_str(m.editor(start, end) + "\n");
-		ssize_t tb_delta(t_str.size() - (m.end - m.begin));
+	void output_target(const string &tag, const char *data, size_t len) {
+		output(output_arg, tag.c_str(), data, len);
+	}
 
-		m.t->body.replace(m.begin + b_delta, m.end + b_delta,
-				  t_str.c_str());
-		b_delta += tb_delta;
+	void warning_msg(const string &msg) {
+		warn(warn_arg, msg.c_str());
 	}
-}
 
-void mx_context::add_line_markup(const string &line)
-{
-	string t_str(
-		bx::regex_replace(line, doc_tag_expr,
-				  function<string (const bx::smatch&)>(
-					bind(&mx_context::replace_doc_tags,
-					     this, placeholders::_1)
-				  )
-		)
-	);
+	/* Conversions of the same source replace each other in the index */
+	toc_entry_t &entry(const string &path) {
+		BOOST_FOREACH(toc_entry_t &t, toc) {
+			if (t.src_path == bf::path(path))
+				return t;
+		}
 
-	add_line_expand(t_str);
+		toc.push_back(path);
+		return toc.back();
+	}
 
-	while(!extra_lines.empty()) {
-		t_iter->second.add_line(extra_lines.back());
-		extra_lines.pop_back();
+	int convert(toc_entry_t &t) {
+		bool rv(::convert(t, cfg));
+
+		name = rv ? t.name : string();
+		error = t.error;
+		return rv ? 0 : -1;
 	}
+};
 
+/* C++ exceptions must not cross the library interface: the ones thrown by
+ * "fn" are stored as the handle error.
+ */
+template <typename fn_t>
+static int mx_guard(mx_converter *mx, fn_t fn)
+{
+	try {
+		fn();
+		return 0;
+	} catch (const exception &err) {
+		mx->error = err.what();
+		return -1;
+	}
 }
 
-void mx_context::add_line_text(const string &line)
+mx_converter *mx_new(void)
 {
-	string t_str(
-		bx::regex_replace(line, text_mark_expr,
-				  function<string (const bx::smatch&)>(
-					bind(&mx_context::replace_text_tags,
-					     this, placeholders::_1)
-				  )
-		)
-	);
-
-	add_line_expand(t_str);
-
+	try {
+		return new mx_converter();
+	} catch (const exception &) {
+		return 0;
+	}
 }
 
-void mx_context::add_line_expand(const string &line)
+void mx_free(mx_converter *mx)
 {
-	line_block_t lines;
-	expand_macros(lines, make_pair(line, in.back().line_cnt),
-		      t_iter->second);
+	delete mx;
+}
 
-	while (!lines.empty() && lines.back().first.empty())
-		lines.pop_back();
+void mx_set_doc_tag(mx_converter *mx, const char *tag)
+{
+	mx_guard(mx, [=]() {
+		mx->cfg.doc_tag = tag ? tag : mx_config().doc_tag;
+	});
+}
 
-	if (!lines.empty()) {
-		/* some macros can be defined after possible expansion */
-		BOOST_FOREACH(auto const &s, lines) {
-			if (s.second)
-				t_iter->second.add_line_mark(s.first, s.second);
-			else
-				t_iter->second.add_line(s.first);
-		}
-	} else
-		t_iter->second.add_line();
+void mx_add_include_dir(mx_converter *mx, const char *dir)
+{
+	mx_guard(mx, [=]() {
+		if (dir)
+			mx->cfg.includes.push_back(dir);
+	});
 }
 
-void mx_context::add_line_macro(const string &line)
+void mx_define(mx_converter *mx, const char *flag)
 {
-	if (c_macro != macros.end())
-		c_macro->second.lines.push_back(
-			make_pair(line, in.back().line_cnt));
+	mx_guard(mx, [=]() {
+		if (flag)
+			mx->cfg.defines.insert(flag);
+	});
 }
 
-void mx_context::add_line_menu(const string &line)
+void mx_config_define(mx_converter *mx, const char *config, const char *flag)
 {
-	static const bx::sregex menu_line_expr(
-		bx::bos >> *bx::_s >> '*' >> *bx::_s >> (bx::s1 = -+bx::_)
-			>> *bx::_s >> "::" >> *bx::_s >> (bx::s2 = -*bx::_)
-			>> *bx::_s >> bx::eos);
-	bx::smatch what;
+	mx_guard(mx, [=]() {
+		if (!config)
+			return;
 
-	if (bx::regex_match(line, what, menu_line_expr)) {
-		t_iter->second.add_line((boost::format("* _`%1%`: %2%")
-					 % what[1] % what[2]).str());
-	}
+		auto &defines(mx->cfg.configs[config]);
+
+		if (flag)
+			defines.insert(flag);
+	});
 }
 
-void mx_context::add_line_info(const string &line)
+void mx_set_output_dir(mx_converter *mx, const char *dir)
 {
-	info_lines.push_back(line);
+	mx_guard(mx, [=]() {
+		mx->cfg.out_dir = dir ? dir : "";
+	});
 }
 
-void mx_context::add_line_asis(const string &line)
+void mx_set_stream_size(mx_converter *mx, size_t size)
 {
-	t_iter->second.add_line(line);
+	mx->cfg.stream_size = size;
 }
 
-void mx_context::add_line_noop(const string &line)
+void mx_set_spill_size(mx_converter *mx, size_t size)
 {
+	mx->cfg.spill_size = size;
 }
 
-static bf::path find_relative(const bf::path &target, const bf::path &ref)
+void mx_set_target_fd(mx_converter *mx, const char *tag, int fd)
 {
-	bf::path rv;
-	auto t_iter(target.begin()), ref_iter(ref.begin());
-
-	do {
-		if ((*t_iter) != (*ref_iter))
-			break;
-		else {
-			++t_iter;
-			++ref_iter;
-		}
-	} while ((t_iter != target.end()) && (ref_iter != ref.end()));
-
-	for (; ref_iter != ref.end(); ++ref_iter)
-		rv /= "..";
-
-	for (; t_iter != target.end(); ++t_iter)
-		rv /= (*t_iter);
-
-	return rv;
+	mx_guard(mx, [=]() {
+		if (tag)
+			mx->cfg.target_fds[tag] = fd;
+	});
 }
 
-void mx_context::parse_line_literal(const string &line)
+void mx_set_check(mx_converter *mx, int enable)
 {
-	bx::smatch what;
+	mx->cfg.check = enable;
+}
 
-	if (bx::regex_match(line, what, gen_mark_expr)) {
-		if (!what[1].length() && (what.str(2) == "end")) {
-			if (envs.empty())
-				throw runtime_error((
-					boost::format("literal line in "
-						      "non-literal "
-						      "environment at %1%")
-					% in.back().location()).str());
+void mx_set_cache(mx_converter *mx, int enable)
+{
+	mx->use_cache = enable;
+}
 
-			if (what.str(3) == envs.top().first) {
-				envs.top().second(this, line);
-				envs.pop();
-				parse_line = &mx_context::parse_line_doc;
-				return;
-			}
-		}
-	}
-	add_line(this, line);
+void mx_set_include_resolver(mx_converter *mx, mx_include_fn resolve,
+			     void *arg)
+{
+	mx->resolve = resolve;
+	mx->resolve_arg = arg;
+
+	mx_guard(mx, [=]() {
+		if (resolve)
+			mx->cache.resolver = bind(&mx_converter::resolve_file,
+						  mx, placeholders::_1,
+						  placeholders::_2);
+		else
+			mx->cache.resolver = 0;
+	});
 }
 
-void mx_context::parse_line_include(const string &line)
+void mx_set_output(mx_converter *mx, mx_output_fn output, void *arg)
 {
-	static const bx::sregex inc_expr(bx::as_xpr('f') | '=' | "include");
+	mx->output = output;
+	mx->output_arg = arg;
+
+	mx_guard(mx, [=]() {
+		if (output)
+			mx->cfg.output = bind(&mx_converter::output_target, mx,
+					      placeholders::_1,
+					      placeholders::_2,
+					      placeholders::_3);
+		else
+			mx->cfg.output = 0;
+	});
+}
 
-	enum tag_level_t t_class(GEN_MARK_TAG);
-	bx::smatch what;
-	what.let(tag_class = t_class);
+void mx_register_tag(mx_converter *mx, const char *name, mx_tag_fn tag_fn,
+		     void *arg)
+{
+	mx_guard(mx, [=]() {
+		if (!name)
+			return;
 
-	if (bx::regex_match(line, what, gen_mark_expr)) {
-		string tag(what[2]);
-		if (regex_match(tag, inc_expr)) {
-			if (auto_end)
-				(*auto_end)(this, tag);
+		const string tag(name);
 
-			auto iter(mx_tags.find(tag));
+		if (!tag_fn) {
+			mx->cfg.site_tags.erase(tag);
+			return;
+		}
 
-			if (iter != mx_tags.end())
-				(*iter).second(this, what.str(3));
+		mx->cfg.site_tags[tag] = [=](const string &line,
+					     string &text) -> bool {
+			const char *t_text(tag_fn(arg, tag.c_str(),
+						  line.c_str()));
 
-			return;
-		} else {
-			if (!regex_search(line, what, tag_class_expr)) {
-				if (auto_end)
-					(*auto_end)(this, tag);
+			if (!t_text)
+				return false;
 
-				return;
-			} else if (t_class == SUB_BLK_TAG)
-				return;
-		}
-	}
-	add_line(this, line);
+			text = t_text;
+			return true;
+		};
+	});
 }
 
-void mx_context::parse_line_doc(const string &line)
+void mx_set_warning(mx_converter *mx, mx_warning_fn warn, void *arg)
 {
-	enum tag_level_t t_class(GEN_MARK_TAG);
-	bx::smatch what;
-	what.let(tag_class = t_class);
-
-	if (bx::regex_match(line, what, gen_mark_expr)) {
-		string tag(what[2]);
-		string arg(what[3]);
+	mx->warn = warn;
+	mx->warn_arg = arg;
 
-		bx::regex_search(line, what, tag_class_expr);
+	mx_guard(mx, [=]() {
+		if (warn)
+			mx->cfg.warn = bind(&mx_converter::warning_msg, mx,
+					    placeholders::_1);
+		else
+			mx->cfg.warn = 0;
+	});
+}
 
-		if ((t_class == GEN_MARK_TAG) && auto_end)
-			(*auto_end)(this, tag);
+int mx_convert_file(mx_converter *mx, const char *path)
+{
+	int rv(-1);
 
-		if (tag.empty())
-			return;
+	if (!path) {
+		mx->error = "no source given";
+		return -1;
+	}
 
-		if ((t_class == GEN_MARK_TAG) || (t_class == SUB_BLK_TAG)) {
-			auto iter(mx_tags.find(tag));
+	mx->select_cache(false);
 
-			if (iter != mx_tags.end())
-				(*iter).second(this, arg);
-			else
-				generic_tag(tag, arg);
+	if (mx_guard(mx, [&]() { rv = mx->convert(mx->entry(path)); }))
+		mx->name.clear();
 
-			return;
-		}
-	}
-	add_line(this, line);
+	return rv;
 }
 
-mx_context::mx_context(const vector<string> &includes_,
-		       const string &doc_tag,
-		       const set<string> &defines_)
-	   :end_pos(0),
-	    doc_iter(out_files.insert(make_pair(doc_tag,
-						target(doc_tag))).first),
-	    t_iter(doc_iter),
-	    c_macro(macros.end()),
-	    includes(includes_.begin(), includes_.end()),
-	    defines(defines_),
-	    parse_line(&mx_context::parse_line_doc),
-	    add_line(&mx_context::add_line_markup),
-	    min_sec_lvl(-1),
-	    abs_sec_lvl(TITLE_LVL),
-	    rel_sec_lvl(TITLE_LVL),
-	    image_cnt(0),
-	    modulename_set(false)
+int mx_convert_buffer(mx_converter *mx, const char *path, const char *data,
+		      size_t len)
 {
-	string t_str;
-
-	/* "includes" is supposed to contain directory pathes, first member is
-	 * an exception, containing the actual input file path.
-	 */
-	in.push_back(new in_file(bf::system_complete(includes_[0])));
-	if (!in.front().s.is_open())
-		throw runtime_error((boost::format("couldn't access file %1%")
-				     % in.front().name).str());
-
-	/* Now, it's pathes all the way down. */
-	includes[0].remove_filename();
-
-	while(true) {
-		while (!in.back().s.eof() && std::getline(in.back().s, t_str)) {
-			in.back().line_cnt++;
-			parse_line(this, t_str);
-		}
-
-		if (auto_end)
-			(*auto_end)(this, string());
+	int rv(-1);
 
-		if (in.size() == 2) {
-			t_iter = doc_iter;
+	if (!path || (!data && len)) {
+		mx->error = "no source given";
+		return -1;
+	}
 
-			bf::path rel_path(find_relative(in[1].name.parent_path()
-							     .file_string(),
-							in[0].name.parent_path()
-							     .file_string()));
+	if (mx_guard(mx, [&]() {
+		const string key(bf::system_complete(path).file_string());
 
-			rel_path /= in[1].base_name;
+		mx->select_cache(true);
+		mx->cache.overlays[key].reset(new string(data, len));
 
-			t_iter->second.add_line();
-			t_iter->second.add_line((boost::format("Include "
-							       ":doc:`%1%`.")
-						 % rel_path.file_string())
-						.str());
+		try {
+			rv = mx->convert(mx->entry(path));
+		} catch (...) {
+			mx->cache.overlays.erase(key);
+			throw;
 		}
 
-		if (in.size() > 1)
-			in.pop_back();
-		else
-			break;
-
-		if (in.size() == 1)
-			parse_line = &mx_context::parse_line_doc;
-	}
+		mx->cache.overlays.erase(key);
+	}))
+		mx->name.clear();
 
-	for (auto t = out_files.begin(); t != out_files.end(); ++t) {
-		late_expand m_expand(*this);
+	return rv;
+}
 
-		for_each(t->second.line_marks.begin(),
-			 t->second.line_marks.end(),
-			 boost::apply_visitor(m_expand));
-	}
+const char *mx_doc_name(const mx_converter *mx)
+{
+	return mx->name.empty() ? 0 : mx->name.c_str();
+}
 
-	for (auto t = out_files.begin(); t != out_files.end(); ++t) {
-		ref_edit m_edit(*this);
+void mx_enable_stats(mx_converter *mx, int enable)
+{
+	mx->cfg.stats = enable ? &mx->stats : 0;
+}
 
-		for_each(t->second.line_marks.begin(),
-			 t->second.line_marks.end(),
-			 boost::apply_visitor(m_edit));
-	}
+const char *mx_stats(mx_converter *mx, int json)
+{
+	if (mx_guard(mx, [=]() {
+		mx->report = stats_report(mx->stats, json);
+	}))
+		return "";
 
+	return mx->report.c_str();
 }
 
-void mx_context::write_out(const bf::path &prefix)
+void mx_enable_profile(mx_converter *mx, int enable)
 {
-	ofstream ofile;
-	bf::path f_path(prefix / in.front().base_name);
+	mx->cfg.profile = enable ? &mx->profile : 0;
+}
 
-	for (auto t = out_files.begin(); t != out_files.end(); ++t) {
-		auto x_path(f_path); /*There can be some funny extensions */
-		x_path.replace_extension(t->first);
+const char *mx_profile(mx_converter *mx, int json)
+{
+	if (mx_guard(mx, [=]() {
+		mx->report = profile_report(mx->profile, json);
+	}))
+		return "";
 
-		ofile.open(x_path.file_string().c_str(), ios::binary);
-		if (ofile.is_open()) {
-			ofile << t->second.body;
-			ofile.close();
-		}
-	}
+	return mx->report.c_str();
 }
 
-struct toc_entry_t {
-	bf::path src_path;
-	string name;
-	string desc;
-
-	toc_entry_t(const string &f_name) : src_path(f_name) {}
-	bf::path parent_path() const { return src_path.parent_path(); }
-	operator const char *() { return src_path.file_string().c_str(); }
-};
+void mx_enable_trace(mx_converter *mx, int enable)
+{
+	mx_guard(mx, [=]() {
+		mx->trace.reset(enable ? new trace_log() : 0);
+	});
+	mx->cfg.trace = mx->trace.get();
+}
 
-void write_index(const bf::path &index_path, const vector<toc_entry_t> &toc)
+const char *mx_trace(mx_converter *mx)
 {
-	ofstream ofile;
-	bf::path full_index_path(bf::system_complete(index_path).parent_path());
+	if (mx_guard(mx, [=]() {
+		mx->report = mx->trace ? mx->trace->str() : string();
+	}))
+		return "";
 
-	ofile.open(index_path.file_string().c_str(), ios::binary);
-	if (!ofile.is_open())
-		return;
+	return mx->report.c_str();
+}
 
-	ofile << ".. toctree::\n   :maxdepth: 2\n\n";
+void mx_enable_memory(mx_converter *mx, int enable)
+{
+	mx->cfg.mem = enable ? &mx->mem : 0;
+}
 
-	BOOST_FOREACH(const toc_entry_t &t, toc) {
-		bf::path rel_path(find_relative(bf::system_complete(t.src_path)
-							.parent_path(),
-						full_index_path));
-		rel_path /= t.name;
+const char *mx_memory(mx_converter *mx)
+{
+	if (mx_guard(mx, [=]() { mx->report = mem_report(mx->mem); }))
+		return "";
 
+	return mx->report.c_str();
+}
 
-		if (!t.desc.empty())
-			ofile << boost::format("   %1% <%2%>\n")
-				 % t.desc % rel_path.file_string();
+int mx_set_engine(mx_converter *mx, const char *engine)
+{
+	return mx_guard(mx, [=]() {
+		const string e(engine ? engine : "");
+
+		if (e == "fast")
+			mx->cfg.engine = mx_config::FAST_ENGINE;
+		else if (e == "legacy")
+			mx->cfg.engine = mx_config::LEGACY_ENGINE;
+		else if (e == "diff")
+			mx->cfg.engine = mx_config::DIFF_ENGINE;
 		else
-			ofile << "   " << rel_path << endl;
-	}
-
-	ofile.close();
+			throw runtime_error("unknown engine " + e);
+	});
 }
 
-int main(int argc, char **argv)
+const char *mx_error(const mx_converter *mx)
 {
-	namespace po = boost::program_options;
+	return mx->error.c_str();
+}
 
-	string doc_tag, index;
-	vector<string> sources;
-	vector<toc_entry_t> toc;
-	vector<string> includes;
-	vector<string> defines;
-	int rc(0);
-
-	po::options_description desc("Options:");
-	desc.add_options()
-		("help,h", "produce this help message")
-		("doc,d", po::value<string>(&doc_tag)
-			     ->default_value("rst"),
-		 "file suffix to put documentation into")
-		("index,x", po::value<string>(&index),
-		 "generate and write out index file")
-		("include,I", po::value< vector<string> >(&includes)
-			      ->composing(),
-		 "search additional paths for MX includes")
-		("define,D", po::value< vector<string> >(&defines)
-			      ->composing(),
-		 "define MX processing flags");
-
-	po::options_description src_desc("source files");
-	src_desc.add(desc)
-		.add_options()
-		 ("sources", po::value< vector<string> >(&sources)->composing(),
-		  "sources");
-
-	po::positional_options_description src_pos;
-	src_pos.add("sources", -1);
-
-	po::variables_map desc_map;
-	po::store(po::command_line_parser(argc, argv)
-		  .options(src_desc).positional(src_pos).run(), desc_map);
-	po::notify(desc_map);
-
-	if (desc_map.count("help")) {
-		cout << "mx2sphinx version 1.0" << endl;
-		cout << "Usage: mx2sphinx [OPTION]... [FILE]..." << endl;
-		cout << desc;
-		return rc;
-	}
-
-	includes.insert(includes.begin(), string());
-
-	if (!desc_map.count("sources"))
-		return 0;
+int mx_write_index(mx_converter *mx, const char *path)
+{
+	if (!path) {
+		mx->error = "no index path given";
+		return -1;
+	}
 
-	ifstream ifile;
+	return mx_guard(mx, [=]() {
+		write_index(bf::path(path), mx->toc, mx->cfg.warn);
+	});
+}
 
-	BOOST_FOREACH(string f, sources) {
-		toc.push_back(f);
-		includes[0] = f;
+int mx_watch(mx_converter *mx, const char *index)
+{
+	mx->select_cache(true);
+	mx_guard(mx, [=]() { watch(mx->toc, mx->cfg, index ? index : ""); });
+	return -1;
+}
 
-		try {
-			mx_context mx(includes, doc_tag,
-				      set<string>(defines.begin(),
-						  defines.end()));
-			mx.write_out(toc.back().parent_path());
-			toc.back().name = mx.in.front().base_name;
-			toc.back().desc = mx.ref_name;
-		} catch (runtime_error err) {
-			cerr << "runtime error: " << err.what()
-			     << endl;
-			toc.pop_back();
-			rc = -1;
-		}
+int mx_serve(mx_converter *mx, const char *sock_path)
+{
+	if (!sock_path) {
+		mx->error = "no socket path given";
+		return -1;
 	}
 
-	if (!index.empty())
-		write_index(bf::path(index), toc);
-
-	return rc;
+	mx->select_cache(true);
+	mx_guard(mx, [=]() { serve(sock_path, mx->cfg); });
+	return -1;
 }
@@ -0,0 +1,164 @@
+/*
+ *  Converter from MX into Sphinx source documentation formats - library
+ *  interface.
+ *
+ *  Copyright (C) 2010 Alex Dubov <oakad@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _MX2SPHINX_H
+#define _MX2SPHINX_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Converter handle; keeps the included files and the macros defined in
+ * them between conversions.
+ */
+typedef struct mx_converter mx_converter;
+
+/* Looks up the file at "path" (a source or an include candidate). Returns
+ * nonzero and sets "data" and "len", if it has one; the data is copied
+ * before the next call.
+ */
+typedef int (*mx_include_fn)(void *arg, const char *path, const char **data,
+			     size_t *len);
+
+/* Receives the converted text of the target with suffix "tag", in one or
+ * more consecutive pieces.
+ */
+typedef void (*mx_output_fn)(void *arg, const char *tag, const char *data,
+			     size_t len);
+
+/* Receives a single warning of a conversion (a message without a line end),
+ * as soon as it is found.
+ */
+typedef void (*mx_warning_fn)(void *arg, const char *msg);
+
+/* Handles the "@<tag> <line>" lines of a site specific tag. Returns the text
+ * (one or more lines) to add in place of the tag line, valid until the next
+ * call, or NULL for the generic tag handling.
+ */
+typedef const char *(*mx_tag_fn)(void *arg, const char *tag,
+				  const char *line);
+
+/* Only the functions declared here are exported by the shared library */
+#pragma GCC visibility push(default)
+
+/* Functions returning int return 0 on success and set the error of the
+ * handle otherwise. A NULL string restores the default of a setting and is
+ * ignored by the functions adding to one.
+ */
+mx_converter *mx_new(void);
+void mx_free(mx_converter *mx);
+
+void mx_set_doc_tag(mx_converter *mx, const char *tag);
+void mx_add_include_dir(mx_converter *mx, const char *dir);
+void mx_define(mx_converter *mx, const char *flag);
+void mx_set_output_dir(mx_converter *mx, const char *dir);
+void mx_set_stream_size(mx_converter *mx, size_t size);
+void mx_set_spill_size(mx_converter *mx, size_t size);
+void mx_set_target_fd(mx_converter *mx, const char *tag, int fd);
+
+/* Adds "flag" (if not NULL) to the named configuration, creating it. With
+ * configurations set, every source is converted once for each, with its
+ * flags on top of the common ones, into a subdirectory of the output
+ * directory named after it.
+ */
+void mx_config_define(mx_converter *mx, const char *config, const char *flag);
+
+/* Sources are only parsed and their macros resolved, no targets are built
+ * or written; every problem found is reported, rather than just the first,
+ * and fails the conversion.
+ */
+void mx_set_check(mx_converter *mx, int enable);
+
+/* Keeps sources, includes and the sections parsed from them between
+ * conversions (default). Without it, sources are read as they are parsed;
+ * buffers, include resolvers, watching and serving always use the cache.
+ */
+void mx_set_cache(mx_converter *mx, int enable);
+
+/* Files not supplied by the resolver are read from disk */
+void mx_set_include_resolver(mx_converter *mx, mx_include_fn resolve,
+			     void *arg);
+/* With an output function set, no target files are written */
+void mx_set_output(mx_converter *mx, mx_output_fn output, void *arg);
+/* Without a warning function set, warnings are dropped */
+void mx_set_warning(mx_converter *mx, mx_warning_fn warn, void *arg);
+/* Tags are looked up among the built-in ones first; a NULL "tag_fn" drops
+ * the handler of "name".
+ */
+void mx_register_tag(mx_converter *mx, const char *name, mx_tag_fn tag_fn,
+		     void *arg);
+
+/* "fast" (default) converts with the file and section caches, streaming
+ * and spilling as configured, "legacy" without any of them, "diff" with
+ * both, reporting the first difference in every target and failing the
+ * conversion, if there is one.
+ */
+int mx_set_engine(mx_converter *mx, const char *engine);
+
+/* Return 0 on success; "-" as a path reads standard input */
+int mx_convert_file(mx_converter *mx, const char *path);
+int mx_convert_buffer(mx_converter *mx, const char *path, const char *data,
+		      size_t len);
+
+/* Base name of the last converted document, error of the last call */
+const char *mx_doc_name(const mx_converter *mx);
+const char *mx_error(const mx_converter *mx);
+
+/* Timing and size statistics of the conversions, as a table or, with
+ * "json" set, a JSON document; valid until the next call.
+ */
+void mx_enable_stats(mx_converter *mx, int enable);
+const char *mx_stats(mx_converter *mx, int json);
+
+/* Calls, time, output size, nesting depth and pass 2 references of every
+ * macro expanded, sorted by the time spent in the macro itself.
+ */
+void mx_enable_profile(mx_converter *mx, int enable);
+const char *mx_profile(mx_converter *mx, int json);
+
+/* Spans of every source, include, late expansion pass and target write,
+ * as a Chrome trace event JSON document.
+ */
+void mx_enable_trace(mx_converter *mx, int enable);
+const char *mx_trace(mx_converter *mx);
+
+/* Approximate memory held by the macro table, the include stack and the
+ * parts of every target, with the peak of each and the source position it
+ * was reached at.
+ */
+void mx_enable_memory(mx_converter *mx, int enable);
+const char *mx_memory(mx_converter *mx);
+
+/* Index of all the documents converted by the handle */
+int mx_write_index(mx_converter *mx, const char *path);
+
+/* Run until an error occurs */
+int mx_watch(mx_converter *mx, const char *index);
+int mx_serve(mx_converter *mx, const char *sock_path);
+
+#pragma GCC visibility pop
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,542 @@
+/*
+ *  Converter from MX into Sphinx source documentation formats - synthetic
+ *  corpus generator and scaling benchmark.
+ *
+ *  Copyright (C) 2010 Alex Dubov <oakad@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <functional>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <boost/program_options.hpp>
+
+#include "mx2sphinx.h"
+
+using namespace std;
+
+/* Shape of a generated corpus */
+struct gen_params {
+	/* Lines of the main document */
+	size_t lines;
+	/* Share of text lines with inline markup */
+	double markup;
+	unsigned int macros;
+	/* Longest chain of macros expanding each other */
+	unsigned int depth;
+	/* Share of macro references preceding the macro definition */
+	double forward;
+	/* Include files form a tree "inc_depth" levels deep, every file
+	 * including "inc_fanout" others.
+	 */
+	unsigned int inc_depth, inc_fanout;
+	/* Generic tag targets the code blocks go to */
+	unsigned int targets;
+	unsigned int seed;
+
+	gen_params()
+	: lines(20000), markup(0.3), macros(100), depth(2), forward(0.1),
+	  inc_depth(1), inc_fanout(2), targets(2), seed(1) {}
+};
+
+struct corpus_gen {
+	const gen_params &p;
+	string dir;
+	mt19937 rng;
+	uniform_real_distribution<double> coin;
+	/* Lines written to all the files */
+	size_t total;
+	vector<string> inc_macros;
+
+	corpus_gen(const gen_params &p_, const string &dir_)
+	: p(p_), dir(dir_), rng(p.seed), coin(0, 1), total(0) {}
+
+	unsigned int pick(unsigned int cnt) {
+		return uniform_int_distribution<unsigned int>(0, cnt - 1)(rng);
+	}
+
+	void line(ostream &out, const string &text) {
+		out << text << '\n';
+		++total;
+	}
+
+	void include(ostream &out, const string &name, unsigned int level);
+	void text_line(ostream &out);
+	string macro_ref(unsigned int defined);
+	void macro_def(ostream &out, unsigned int m);
+	void main_doc();
+};
+
+/* Include files only contribute macros */
+void corpus_gen::include(ostream &out, const string &name, unsigned int level)
+{
+	ofstream inc((dir + "/" + name + ".mx").c_str());
+
+	line(out, "@include " + name + ".mx");
+	line(inc, "@= im_" + name);
+	line(inc, "from include " + name + " @1");
+	inc_macros.push_back("im_" + name);
+
+	if (level < p.inc_depth) {
+		for (unsigned int f(0); f < p.inc_fanout; ++f)
+			include(inc, (boost::format("%s_%u") % name % f).str(),
+				level + 1);
+	}
+}
+
+void corpus_gen::text_line(ostream &out)
+{
+	static const char *words[] = {
+		"the", "converter", "reads", "macro", "definitions", "and",
+		"writes", "documentation", "with", "code", "blocks", "into",
+		"separate", "targets"
+	};
+	static const char *marks[] = {
+		"@emph{%s}", "@code{%s}", "@%%%s@", "@#%s@", "@strong{%s}",
+		"@verb{%s}"
+	};
+	const unsigned int w_cnt(sizeof(words) / sizeof(words[0]));
+	const unsigned int m_cnt(sizeof(marks) / sizeof(marks[0]));
+	string rv;
+
+	for (unsigned int w(0); w < 10; ++w) {
+		if (w)
+			rv += ' ';
+
+		rv += words[pick(w_cnt)];
+	}
+
+	if (coin(rng) < p.markup)
+		rv += " " + (boost::format(marks[pick(m_cnt)])
+			     % words[pick(w_cnt)]).str();
+
+	line(out, rv);
+}
+
+/* Reference to a macro, defined before ("defined" macros are) or after */
+string corpus_gen::macro_ref(unsigned int defined)
+{
+	unsigned int m;
+
+	if (!inc_macros.empty() && (coin(rng) < 0.2))
+		return "@:" + inc_macros[pick(inc_macros.size())] + "(x)@";
+
+	if (!p.macros)
+		return "0";
+
+	if (defined && ((defined == p.macros) || (coin(rng) >= p.forward)))
+		m = pick(defined);
+	else
+		m = defined + pick(p.macros - defined);
+
+	return (boost::format("@:m%u(%u)@") % m % pick(100)).str();
+}
+
+/* Every macro in a chain of "depth" expands the previous one */
+void corpus_gen::macro_def(ostream &out, unsigned int m)
+{
+	line(out, (boost::format("@= m%u") % m).str());
+	line(out, (boost::format("value of @1 in m%u") % m).str());
+
+	if (m % p.depth)
+		line(out, (boost::format("  nested @:m%u(@1)@") % (m - 1))
+			  .str());
+}
+
+void corpus_gen::main_doc()
+{
+	ofstream out((dir + "/corpus.mx").c_str());
+	size_t start(total), block(0);
+	unsigned int defined(0);
+	size_t def_every(p.lines / (p.macros + 1) + 1);
+
+	line(out, "@t Synthetic corpus");
+	line(out, "@* Generated module");
+
+	if (p.inc_depth) {
+		for (unsigned int f(0); f < p.inc_fanout; ++f)
+			include(out, (boost::format("inc_%u") % f).str(), 1);
+	}
+
+	while ((total - start) < p.lines) {
+		if (!(block % 8))
+			line(out, (boost::format("@+ Section %u") % block).str());
+		else
+			line(out, (boost::format("@- Paragraph %u")
+				   % block).str());
+
+		for (unsigned int l(0); l < 4; ++l)
+			text_line(out);
+
+		while ((defined < p.macros)
+		       && ((total - start) >= (defined + 1) * def_every))
+			macro_def(out, defined++);
+
+		line(out, (boost::format("@t%u") % (block % p.targets)).str());
+
+		for (unsigned int l(0); l < 4; ++l)
+			line(out, (boost::format("int f%u_%u(void) { return %s; }")
+				   % block % l % macro_ref(defined)).str());
+
+		++block;
+	}
+
+	/* Forward references to all of them must resolve */
+	while (defined < p.macros)
+		macro_def(out, defined++);
+}
+
+/* Writes "corpus.mx" and its includes into "dir"; returns the number of
+ * lines in all of them.
+ */
+static size_t generate(const gen_params &p, const string &dir)
+{
+	corpus_gen gen(p, dir);
+
+	mkdir(dir.c_str(), 0755);
+	gen.main_doc();
+	return gen.total;
+}
+
+static double mono_time()
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Converts the corpus in a child process, so its peak memory use is
+ * measured alone.
+ */
+static bool measure(const string &dir, double &secs, long &peak_kb)
+{
+	double t_start(mono_time());
+	pid_t pid(fork());
+	int status;
+	rusage ru;
+
+	if (pid < 0)
+		return false;
+
+	if (!pid) {
+		mx_converter *mx(mx_new());
+
+		mx_set_output_dir(mx, dir.c_str());
+		_exit(mx_convert_file(mx, (dir + "/corpus.mx").c_str()));
+	}
+
+	if ((wait4(pid, &status, 0, &ru) != pid) || !WIFEXITED(status)
+	    || WEXITSTATUS(status))
+		return false;
+
+	secs = mono_time() - t_start;
+	peak_kb = ru.ru_maxrss;
+	return true;
+}
+
+/* Corpus dimension, grown one at a time from the default shape */
+struct scale_dim {
+	const char *name;
+	vector<double> values;
+	function<void (gen_params &, double)> set;
+};
+
+struct scale_result {
+	string dim;
+	double value;
+	size_t lines;
+	double rate;
+	long peak_kb;
+};
+
+static vector<scale_dim> scale_dims()
+{
+	vector<scale_dim> rv;
+
+	rv.push_back(scale_dim{"lines", {5000, 10000, 20000, 40000, 80000},
+		     [](gen_params &p, double v) { p.lines = v; }});
+	rv.push_back(scale_dim{"markup", {0, 0.25, 0.5, 0.75, 1},
+		     [](gen_params &p, double v) { p.markup = v; }});
+	rv.push_back(scale_dim{"macros", {0, 50, 200, 800, 3200},
+		     [](gen_params &p, double v) { p.macros = v; }});
+	rv.push_back(scale_dim{"depth", {1, 2, 4, 8, 16},
+		     [](gen_params &p, double v) { p.depth = v; }});
+	rv.push_back(scale_dim{"forward", {0, 0.25, 0.5, 0.75, 1},
+		     [](gen_params &p, double v) { p.forward = v; }});
+	rv.push_back(scale_dim{"inc_depth", {0, 1, 2, 3, 4},
+		     [](gen_params &p, double v) { p.inc_depth = v; }});
+	rv.push_back(scale_dim{"inc_fanout", {1, 2, 4, 8},
+		     [](gen_params &p, double v) {
+			p.inc_depth = 2;
+			p.inc_fanout = v;
+		     }});
+	rv.push_back(scale_dim{"targets", {1, 2, 4, 8, 16},
+		     [](gen_params &p, double v) { p.targets = v; }});
+	return rv;
+}
+
+/* Gnuplot script drawing throughput and peak memory against every
+ * dimension.
+ */
+static void write_plot(const string &name, const vector<scale_result> &res)
+{
+	ofstream out(name.c_str());
+	string png(name.substr(0, name.rfind('.')) + ".png");
+	vector<string> dims;
+
+	BOOST_FOREACH(const scale_result &r, res) {
+		if (dims.empty() || (dims.back() != r.dim))
+			dims.push_back(r.dim);
+	}
+
+	out << "set terminal png size 1200," << 300 * dims.size() << '\n'
+	    << "set output '" << png << "'\n"
+	    << "set multiplot layout " << dims.size() << ",1\n"
+	    << "set ylabel 'lines/s'\nset y2label 'peak KiB'\n"
+	    << "set ytics nomirror\nset y2tics\n";
+
+	BOOST_FOREACH(const string &d, dims) {
+		out << "set xlabel '" << d << "'\n"
+		    << "plot '-' using 1:2 with linespoints title 'lines/s', "
+		    << "'-' using 1:2 axes x1y2 with linespoints "
+		    << "title 'peak KiB'\n";
+
+		for (int col(0); col < 2; ++col) {
+			BOOST_FOREACH(const scale_result &r, res) {
+				if (r.dim != d)
+					continue;
+
+				out << r.value << ' ';
+
+				if (col)
+					out << r.peak_kb << '\n';
+				else
+					out << r.rate << '\n';
+			}
+			out << "e\n";
+		}
+	}
+
+	out << "unset multiplot\n";
+}
+
+/* Runs every dimension; returns nonzero, if a run is slower or larger than
+ * the baseline allows.
+ */
+static int scale_bench(const string &work, unsigned int runs,
+		       const string &baseline, const string &save,
+		       const string &plot, double tolerance)
+{
+	map<string, pair<double, long>> base;
+	vector<scale_result> res;
+	int rc(0);
+
+	if (!baseline.empty()) {
+		ifstream in(baseline.c_str());
+		string dim;
+		double value, rate;
+		long peak_kb;
+
+		if (!in)
+			cerr << "can't read baseline " << baseline << endl;
+
+		while (in >> dim >> value >> rate >> peak_kb)
+			base[(boost::format("%s %g") % dim % value).str()]
+				= make_pair(rate, peak_kb);
+	}
+
+	cout << boost::format("%-12s %8s %10s %12s %10s  %s\n")
+		% "dimension" % "value" % "lines" % "lines/s" % "peak KiB"
+		% "baseline";
+
+	BOOST_FOREACH(const scale_dim &d, scale_dims()) {
+		BOOST_FOREACH(double v, d.values) {
+			gen_params p;
+			scale_result r{d.name, v, 0, 0, 0};
+			const string key((boost::format("%s %g") % d.name % v)
+					 .str());
+
+			d.set(p, v);
+			r.lines = generate(p, work);
+
+			for (unsigned int cnt(0); cnt < runs; ++cnt) {
+				double secs;
+				long peak_kb;
+
+				if (!measure(work, secs, peak_kb)) {
+					cerr << "conversion of " << key
+					     << " failed" << endl;
+					return -1;
+				}
+
+				r.rate = max(r.rate, r.lines / secs);
+				r.peak_kb = cnt ? min(r.peak_kb, peak_kb)
+						: peak_kb;
+			}
+
+			cout << boost::format("%-12s %8g %10u %12.0f %10u  ")
+				% d.name % v % r.lines % r.rate % r.peak_kb;
+
+			auto b_iter(base.find(key));
+
+			if (b_iter == base.end())
+				cout << "-\n";
+			else {
+				double d_rate(r.rate / b_iter->second.first - 1);
+				double d_peak(double(r.peak_kb)
+					      / b_iter->second.second - 1);
+				bool bad((d_rate < -tolerance)
+					 || (d_peak > tolerance));
+
+				cout << boost::format("%+.1f%% %+.1f%%%s\n")
+					% (d_rate * 100) % (d_peak * 100)
+					% (bad ? " REGRESSION" : "");
+
+				if (bad)
+					rc = 1;
+			}
+
+			res.push_back(r);
+		}
+	}
+
+	if (!save.empty()) {
+		ofstream out(save.c_str());
+
+		BOOST_FOREACH(const scale_result &r, res)
+			out << r.dim << ' ' << r.value << ' ' << r.rate << ' '
+			    << r.peak_kb << '\n';
+	}
+
+	if (!plot.empty())
+		write_plot(plot, res);
+
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	namespace po = boost::program_options;
+
+	gen_params p;
+	string dir, baseline, save, plot;
+	unsigned int runs;
+	double tolerance;
+
+	po::options_description desc("Options:");
+	desc.add_options()
+		("help,h", "produce this help message")
+		("lines,l", po::value<size_t>(&p.lines)
+			    ->default_value(p.lines),
+		 "lines of the main document")
+		("markup,m", po::value<double>(&p.markup)
+			     ->default_value(p.markup),
+		 "share of text lines with inline markup")
+		("macros", po::value<unsigned int>(&p.macros)
+			   ->default_value(p.macros),
+		 "number of macros defined")
+		("depth", po::value<unsigned int>(&p.depth)
+			  ->default_value(p.depth),
+		 "macro nesting depth")
+		("forward", po::value<double>(&p.forward)
+			    ->default_value(p.forward),
+		 "share of macro references preceding the definition")
+		("inc-depth", po::value<unsigned int>(&p.inc_depth)
+			      ->default_value(p.inc_depth),
+		 "include nesting depth")
+		("inc-fanout", po::value<unsigned int>(&p.inc_fanout)
+			       ->default_value(p.inc_fanout),
+		 "files included by every file")
+		("targets", po::value<unsigned int>(&p.targets)
+			    ->default_value(p.targets),
+		 "number of generic tag targets")
+		("seed", po::value<unsigned int>(&p.seed)
+			 ->default_value(p.seed),
+		 "random generator seed")
+		("scale", "benchmark conversions of corpora growing in every "
+			  "dimension, one at a time")
+		("runs", po::value<unsigned int>(&runs)->default_value(3),
+		 "conversions of every corpus, the fastest one counts")
+		("baseline", po::value<string>(&baseline),
+		 "fail, when slower or larger than recorded in the given "
+		 "file")
+		("save-baseline", po::value<string>(&save),
+		 "record the results into the given file")
+		("tolerance", po::value<double>(&tolerance)
+			      ->default_value(0.2),
+		 "allowed relative difference to the baseline")
+		("plot", po::value<string>(&plot),
+		 "write a gnuplot script of the results into the given file")
+		("dir", po::value<string>(&dir),
+		 "directory to write the corpus into");
+
+	po::positional_options_description dir_pos;
+	dir_pos.add("dir", 1);
+
+	po::variables_map desc_map;
+	po::store(po::command_line_parser(argc, argv)
+		  .options(desc).positional(dir_pos).run(), desc_map);
+	po::notify(desc_map);
+
+	if (desc_map.count("help")) {
+		cout << "Usage: mxgen [OPTION]... DIR" << endl;
+		cout << "       mxgen --scale [OPTION]... [DIR]" << endl;
+		cout << desc;
+		return 0;
+	}
+
+	if (!p.depth || !p.targets) {
+		cerr << "depth and targets must be positive" << endl;
+		return -1;
+	}
+
+	if (desc_map.count("scale")) {
+		if (dir.empty()) {
+			char t_dir[] = "/tmp/mxgen.XXXXXX";
+
+			if (!mkdtemp(t_dir)) {
+				cerr << "can't create work directory" << endl;
+				return -1;
+			}
+			dir = t_dir;
+		}
+
+		return scale_bench(dir, runs, baseline, save, plot,
+				   tolerance);
+	}
+
+	if (dir.empty()) {
+		cerr << "no output directory given" << endl;
+		return -1;
+	}
+
+	cout << generate(p, dir) << " lines written" << endl;
+	return 0;
+}
@@ -0,0 +1,11 @@
+#line 17 "macros_targets.mx"
+
+#line 6 "macros_targets.mx"
+int counter;
+
+#line 17 "macros_targets.mx"
+int main(void)
+{
+	return counter;
+}
+
@@ -0,0 +1,3 @@
+int counter;
+extern int later;
+
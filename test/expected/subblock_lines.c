@@ -0,0 +1,7 @@
+#line 5 "subblock_lines.mx"
+int a;
+int b;
+#line 9 "subblock_lines.mx"
+#line 11 "subblock_lines.mx"
+int c;
+int d;